@@ -0,0 +1,219 @@
+#include "Animation.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+void Animator::Tracks::add(cl_int target, size_t num_keys, bool loop, float offset)
+{
+    size_t keys_end = key_time.size();
+    this->target.push_back(target);
+    first.push_back(keys_end - num_keys);
+    count.push_back(num_keys);
+    cursor.push_back(0);
+    duration.push_back(num_keys > 0 ? key_time.back() : 0.0f);
+    this->offset.push_back(offset);
+    this->loop.push_back(loop);
+    a.push_back(-1);
+    b.push_back(-1);
+    weight.push_back(0.0f);
+    changed.push_back(true);
+}
+
+// Key times are stored relative to the first key of their track. The
+// cursor remembers last frame's key, so playing forward costs one step.
+// A track clamped at the end of its clip keeps its keys and weight, and
+// is not changed again.
+void Animator::Tracks::find_keys(float time)
+{
+    size_t n = target.size();
+    for (size_t t = 0; t < n; t++) {
+        const float* times = &key_time[first[t]];
+        int keys = count[t];
+        float d = duration[t];
+        float local = time + offset[t];
+        local = loop[t] && d > 0.0f ? local - d * std::floor(local / d)
+                                    : std::min(std::max(local, 0.0f), d);
+
+        int k = cursor[t];
+        if (k >= keys || times[k] > local) {
+            k = 0;
+        }
+        while (k + 1 < keys && times[k + 1] <= local) {
+            k++;
+        }
+        cursor[t] = k;
+        int next = std::min(k + 1, keys - 1);
+        float span = times[next] - times[k];
+        cl_int key_a = first[t] + k;
+        cl_int key_b = first[t] + next;
+        float w = span > 0.0f ? std::min(std::max((local - times[k]) / span, 0.0f), 1.0f)
+                              : 0.0f;
+        changed[t] = key_a != a[t] || key_b != b[t] || w != weight[t];
+        a[t] = key_a;
+        b[t] = key_b;
+        weight[t] = w;
+    }
+}
+
+void Animator::Channel::gather(const Tracks& tracks)
+{
+    size_t n = tracks.a.size();
+    from.resize(n);
+    to.resize(n);
+    value.resize(n);
+    for (size_t t = 0; t < n; t++) {
+        from[t] = keys[tracks.a[t]];
+        to[t] = keys[tracks.b[t]];
+    }
+}
+
+void Animator::Channel::lerp(const std::vector<float>& weight)
+{
+    size_t n = weight.size();
+    const float* f = from.data();
+    const float* g = to.data();
+    const float* w = weight.data();
+    float* v = value.data();
+    for (size_t t = 0; t < n; t++) {
+        v[t] = f[t] + (g[t] - f[t]) * w[t];
+    }
+}
+
+void Animator::add_track(cl_int node, const Transform& base,
+                         const std::vector<InstanceKey>& keys, bool loop, float offset)
+{
+    if (keys.empty()) {
+        return;
+    }
+    for (auto & key : keys) {
+        instance_tracks.key_time.push_back(key.time - keys.front().time);
+        for (int j = 0; j < 3; j++) {
+            position[j].keys.push_back(key.position[j]);
+        }
+        orientation[0].keys.push_back(key.orientation.x);
+        orientation[1].keys.push_back(key.orientation.y);
+        orientation[2].keys.push_back(key.orientation.z);
+        orientation[3].keys.push_back(key.orientation.w);
+        scale.keys.push_back(key.scale);
+    }
+    instance_tracks.add(node, keys.size(), loop, offset);
+    base_transform.push_back(base);
+}
+
+void Animator::add_track(cl_int light, const Light& base,
+                         const std::vector<LightKey>& keys, bool loop, float offset)
+{
+    if (keys.empty()) {
+        return;
+    }
+    for (auto & key : keys) {
+        light_tracks.key_time.push_back(key.time - keys.front().time);
+        for (int j = 0; j < 3; j++) {
+            location[j].keys.push_back(key.location[j]);
+            color[j].keys.push_back(key.color[j]);
+        }
+        radius.keys.push_back(key.radius);
+    }
+    light_tracks.add(light, keys.size(), loop, offset);
+    base_light.push_back(base);
+}
+
+size_t Animator::size() const
+{
+    return instance_tracks.target.size() + light_tracks.target.size();
+}
+
+// Shortest arc slerp of every instance track at once, falling back to
+// lerp where the keys are too close for sin(theta) to be divided by.
+void Animator::slerp()
+{
+    size_t n = instance_tracks.weight.size();
+    const float* w = instance_tracks.weight.data();
+    const float* ax = orientation[0].from.data();
+    const float* ay = orientation[1].from.data();
+    const float* az = orientation[2].from.data();
+    const float* aw = orientation[3].from.data();
+    const float* bx = orientation[0].to.data();
+    const float* by = orientation[1].to.data();
+    const float* bz = orientation[2].to.data();
+    const float* bw = orientation[3].to.data();
+    float* x = orientation[0].value.data();
+    float* y = orientation[1].value.data();
+    float* z = orientation[2].value.data();
+    float* qw = orientation[3].value.data();
+    for (size_t t = 0; t < n; t++) {
+        float d = ax[t] * bx[t] + ay[t] * by[t] + az[t] * bz[t] + aw[t] * bw[t];
+        float s = d < 0.0f ? -1.0f : 1.0f;
+        d *= s;
+        float theta = std::acos(std::min(d, 1.0f));
+        float sin_theta = std::sin(theta);
+        bool close = sin_theta < 1e-4f;
+        float wa = close ? 1.0f - w[t] : std::sin((1.0f - w[t]) * theta) / sin_theta;
+        float wb = (close ? w[t] : std::sin(w[t] * theta) / sin_theta) * s;
+        float rx = wa * ax[t] + wb * bx[t];
+        float ry = wa * ay[t] + wb * by[t];
+        float rz = wa * az[t] + wb * bz[t];
+        float rw = wa * aw[t] + wb * bw[t];
+        float norm = 1.0f / std::sqrt(rx * rx + ry * ry + rz * rz + rw * rw);
+        x[t] = rx * norm;
+        y[t] = ry * norm;
+        z[t] = rz * norm;
+        qw[t] = rw * norm;
+    }
+}
+
+void Animator::evaluate(float time, SceneGraph& graph,
+                        std::vector<Light>& lights, DirtyRanges& dirty_lights)
+{
+    instance_tracks.find_keys(time);
+    for (auto & channel : position) {
+        channel.gather(instance_tracks);
+        channel.lerp(instance_tracks.weight);
+    }
+    for (auto & channel : orientation) {
+        channel.gather(instance_tracks);
+    }
+    slerp();
+    scale.gather(instance_tracks);
+    scale.lerp(instance_tracks.weight);
+
+    for (size_t t = 0; t < instance_tracks.target.size(); t++) {
+        if (!instance_tracks.changed[t]) {
+            continue;
+        }
+        const Transform & base = base_transform[t];
+        glm::quat q(orientation[3].value[t], orientation[0].value[t],
+                    orientation[1].value[t], orientation[2].value[t]);
+        Transform local;
+        local.position = base.position + glm::vec3(position[0].value[t], position[1].value[t],
+                                                   position[2].value[t]);
+        local.orientation = q * base.orientation;
+        local.scale = base.scale * scale.value[t];
+        graph.set_local(instance_tracks.target[t], local);
+    }
+
+    light_tracks.find_keys(time);
+    for (int j = 0; j < 3; j++) {
+        location[j].gather(light_tracks);
+        location[j].lerp(light_tracks.weight);
+        color[j].gather(light_tracks);
+        color[j].lerp(light_tracks.weight);
+    }
+    radius.gather(light_tracks);
+    radius.lerp(light_tracks.weight);
+
+    for (size_t t = 0; t < light_tracks.target.size(); t++) {
+        if (!light_tracks.changed[t]) {
+            continue;
+        }
+        cl_int l = light_tracks.target[t];
+        const Light & base = base_light[t];
+        Light & light = lights[l];
+        for (int j = 0; j < 3; j++) {
+            light.location.s[j] = base.location.s[j] + location[j].value[t];
+            light.color.s[j] = base.color.s[j] * color[j].value[t];
+        }
+        light.radius = base.radius * radius.value[t];
+        dirty_lights.mark(l);
+    }
+}
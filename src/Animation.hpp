@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "DirtyRanges.hpp"
+#include "Primitives.hpp"
+#include "SceneGraph.hpp"
+
+// Keys are relative to the local placement the scene file gives the
+// node: positions are added, orientations applied on top, scales
+// multiplied.
+struct InstanceKey {
+    float time;
+    glm::vec3 position;
+    glm::quat orientation;
+    float scale;
+};
+
+struct LightKey {
+    float time;
+    glm::vec3 location;
+    glm::vec3 color;
+    float radius;
+};
+
+// Keyframe tracks for scene graph nodes and lights, stored as structure of arrays.
+// evaluate() finds every track's key pair first and then blends all tracks
+// of a kind in flat loops over contiguous floats, which the compiler can
+// vectorise, before scattering the results into the scene mirrors.
+class Animator {
+public:
+    void add_track(cl_int node, const Transform& base,
+                   const std::vector<InstanceKey>& keys, bool loop, float offset);
+    void add_track(cl_int light, const Light& base,
+                   const std::vector<LightKey>& keys, bool loop, float offset);
+    void evaluate(float time, SceneGraph& graph,
+                  std::vector<Light>& lights, DirtyRanges& dirty_lights);
+    size_t size() const;
+
+private:
+    struct Tracks {
+        std::vector<cl_int> target;
+        std::vector<cl_int> first;
+        std::vector<cl_int> count;
+        std::vector<cl_int> cursor;
+        std::vector<float> duration;
+        std::vector<float> offset;
+        std::vector<uint8_t> loop;
+        std::vector<float> key_time;
+
+        // Per frame: key pair and blend weight of every track, and whether
+        // any of them differs from the frame before.
+        std::vector<cl_int> a;
+        std::vector<cl_int> b;
+        std::vector<float> weight;
+        std::vector<uint8_t> changed;
+
+        void add(cl_int target, size_t num_keys, bool loop, float offset);
+        void find_keys(float time);
+    };
+
+    // Channels are split per component so the blend loops stay unit stride.
+    struct Channel {
+        std::vector<float> keys;
+        std::vector<float> from;
+        std::vector<float> to;
+        std::vector<float> value;
+
+        void gather(const Tracks& tracks);
+        void lerp(const std::vector<float>& weight);
+    };
+
+    Tracks instance_tracks;
+    Channel position[3];
+    Channel orientation[4];
+    Channel scale;
+    std::vector<Transform> base_transform;
+
+    Tracks light_tracks;
+    Channel location[3];
+    Channel color[3];
+    Channel radius;
+    std::vector<Light> base_light;
+
+    void slerp();
+};
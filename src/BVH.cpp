@@ -0,0 +1,303 @@
+#include "BVH.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/gtc/quaternion.hpp>
+
+static AABB empty_bounds()
+{
+    AABB bounds;
+    bounds.min = {{INFINITY, INFINITY, INFINITY}};
+    bounds.max = {{-INFINITY, -INFINITY, -INFINITY}};
+    return bounds;
+}
+
+static void grow(AABB& bounds, const AABB& other)
+{
+    for (int j = 0; j < 3; j++) {
+        bounds.min.s[j] = std::min(bounds.min.s[j], other.min.s[j]);
+        bounds.max.s[j] = std::max(bounds.max.s[j], other.max.s[j]);
+    }
+}
+
+// World space box around all eight transformed corners of the mesh bounds.
+AABB instance_bounds(const Instance& instance, const AABB& bounds)
+{
+    AABB world = empty_bounds();
+    for (int corner = 0; corner < 8; corner++) {
+        glm::vec3 p((corner & 1 ? bounds.max : bounds.min).s[0],
+                    (corner & 2 ? bounds.max : bounds.min).s[1],
+                    (corner & 4 ? bounds.max : bounds.min).s[2]);
+        p = instance.orientation * (p * instance.scale);
+        for (int j = 0; j < 3; j++) {
+            world.min.s[j] = std::min(world.min.s[j], p[j] + instance.position.s[j]);
+            world.max.s[j] = std::max(world.max.s[j], p[j] + instance.position.s[j]);
+        }
+    }
+    return world;
+}
+
+static void build_node(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+                       std::vector<cl_int>& indices, size_t node, size_t first,
+                       size_t count, int depth)
+{
+    if (depth >= bvh_max_depth) {
+        throw std::runtime_error("BVH too deep");
+    }
+
+    AABB node_bounds = empty_bounds();
+    AABB centroids = empty_bounds();
+    for (size_t i = first; i < first + count; i++) {
+        const AABB & b = bounds[indices[i]];
+        grow(node_bounds, b);
+        AABB centroid;
+        for (int j = 0; j < 3; j++) {
+            centroid.min.s[j] = centroid.max.s[j] = (b.min.s[j] + b.max.s[j]) * 0.5f;
+        }
+        grow(centroids, centroid);
+    }
+    nodes[node].bounds = node_bounds;
+
+    if (count <= (size_t)bvh_leaf_size) {
+        nodes[node].first = first;
+        nodes[node].count = count;
+        return;
+    }
+
+    int axis = 0;
+    for (int j = 1; j < 3; j++) {
+        if (centroids.max.s[j] - centroids.min.s[j]
+          > centroids.max.s[axis] - centroids.min.s[axis]) {
+            axis = j;
+        }
+    }
+    // Median split, which bounds the depth at log2 of the instance count.
+    size_t half = count / 2;
+    std::nth_element(indices.begin() + first, indices.begin() + first + half,
+                     indices.begin() + first + count, [&](cl_int a, cl_int b) {
+        return bounds[a].min.s[axis] + bounds[a].max.s[axis]
+             < bounds[b].min.s[axis] + bounds[b].max.s[axis];
+    });
+
+    size_t children = nodes.size();
+    nodes.resize(children + 2);
+    nodes[node].first = children;
+    nodes[node].count = 0;
+    build_node(bounds, nodes, indices, children, first, half, depth + 1);
+    build_node(bounds, nodes, indices, children + 1, first + half, count - half, depth + 1);
+}
+
+// Top level tree over instance bounds. Children are allocated in pairs
+// after their parent, so walking the nodes backwards visits children
+// before parents.
+void build_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+               std::vector<cl_int>& indices)
+{
+    nodes.clear();
+    indices.resize(bounds.size());
+    for (size_t i = 0; i < bounds.size(); i++) {
+        indices[i] = i;
+    }
+    if (bounds.empty()) {
+        return;
+    }
+    nodes.reserve(2 * bounds.size() / bvh_leaf_size + 1);
+    nodes.resize(1);
+    build_node(bounds, nodes, indices, 0, 0, bounds.size(), 0);
+}
+
+static bool same_bounds(const AABB& a, const AABB& b)
+{
+    for (int j = 0; j < 3; j++) {
+        if (a.min.s[j] != b.min.s[j] || a.max.s[j] != b.max.s[j]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Parent of every node (-1 for the root) and the leaf holding every
+// instance, so refit_bvh can walk up from a moved instance.
+void link_bvh(const std::vector<BVHNode>& nodes, const std::vector<cl_int>& indices,
+              std::vector<cl_int>& parents, std::vector<cl_int>& leaves)
+{
+    parents.assign(nodes.size(), -1);
+    leaves.assign(indices.size(), -1);
+    for (size_t n = 0; n < nodes.size(); n++) {
+        const BVHNode & node = nodes[n];
+        if (node.count > 0) {
+            for (cl_int i = node.first; i < node.first + node.count; i++) {
+                leaves[indices[i]] = n;
+            }
+        } else {
+            parents[node.first] = n;
+            parents[node.first + 1] = n;
+        }
+    }
+}
+
+// Recomputes the bounds from leaf up to the root, keeping the topology.
+// The walk stops at the first node whose bounds come out unchanged, so
+// several instances moving under one subtree only pay for it once.
+void refit_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+               const std::vector<cl_int>& indices, const std::vector<cl_int>& parents,
+               cl_int leaf, DirtyRanges& dirty)
+{
+    for (cl_int n = leaf; n >= 0; n = parents[n]) {
+        BVHNode & node = nodes[n];
+        AABB refit = empty_bounds();
+        if (node.count > 0) {
+            for (cl_int i = node.first; i < node.first + node.count; i++) {
+                grow(refit, bounds[indices[i]]);
+            }
+        } else {
+            grow(refit, nodes[node.first].bounds);
+            grow(refit, nodes[node.first + 1].bounds);
+        }
+        if (same_bounds(refit, node.bounds)) {
+            break;
+        }
+        node.bounds = refit;
+        dirty.mark(n);
+    }
+}
+
+static float surface_area(const AABB& bounds)
+{
+    float x = bounds.max.s[0] - bounds.min.s[0];
+    float y = bounds.max.s[1] - bounds.min.s[1];
+    float z = bounds.max.s[2] - bounds.min.s[2];
+    return x * y + y * z + z * x;
+}
+
+// Descends to the leaf whose bounds grow the least and either appends the
+// instance to it, when its range is the last one in indices and has room,
+// or splits it into the old leaf and a new leaf holding only the instance.
+// New nodes go at the end, so children still come after their parents.
+// Returns false, leaving the tree untouched, when the split would exceed
+// bvh_max_depth; the caller rebuilds instead.
+bool insert_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+                std::vector<cl_int>& indices, std::vector<cl_int>& parents,
+                std::vector<cl_int>& leaves, cl_int instance,
+                DirtyRanges& dirty_nodes, DirtyRanges& dirty_indices)
+{
+    const AABB & b = bounds[instance];
+    if (leaves.size() <= (size_t)instance) {
+        leaves.resize(instance + 1, -1);
+    }
+    cl_int slot = indices.size();
+    if (nodes.empty()) {
+        nodes.push_back({ b, slot, 1 });
+        parents.push_back(-1);
+        indices.push_back(instance);
+        leaves[instance] = 0;
+        dirty_nodes.mark(0);
+        dirty_indices.mark(slot);
+        return true;
+    }
+
+    cl_int n = 0;
+    int depth = 0;
+    while (nodes[n].count == 0) {
+        cl_int best = nodes[n].first;
+        float best_growth = INFINITY;
+        for (cl_int c = nodes[n].first; c < nodes[n].first + 2; c++) {
+            AABB grown = nodes[c].bounds;
+            grow(grown, b);
+            float growth = surface_area(grown) - surface_area(nodes[c].bounds);
+            if (growth < best_growth) {
+                best = c;
+                best_growth = growth;
+            }
+        }
+        n = best;
+        depth++;
+    }
+
+    BVHNode leaf = nodes[n];
+    if (leaf.first + leaf.count == slot && leaf.count < bvh_leaf_size) {
+        indices.push_back(instance);
+        nodes[n].count++;
+        leaves[instance] = n;
+        dirty_nodes.mark(n);
+        dirty_indices.mark(slot);
+        refit_bvh(bounds, nodes, indices, parents, n, dirty_nodes);
+        return true;
+    }
+    if (depth + 1 >= bvh_max_depth) {
+        return false;
+    }
+
+    cl_int children = nodes.size();
+    indices.push_back(instance);
+    nodes.push_back(leaf);
+    nodes.push_back({ b, slot, 1 });
+    parents.push_back(n);
+    parents.push_back(n);
+    for (cl_int i = leaf.first; i < leaf.first + leaf.count; i++) {
+        leaves[indices[i]] = children;
+    }
+    leaves[instance] = children + 1;
+    nodes[n].first = children;
+    nodes[n].count = 0;
+    dirty_nodes.mark(n);
+    dirty_nodes.mark(children, 2);
+    dirty_indices.mark(slot);
+    refit_bvh(bounds, nodes, indices, parents, n, dirty_nodes);
+    return true;
+}
+
+// Takes the instance out of its leaf, swapping the last entry of the
+// leaf's range into its slot. A leaf left empty is replaced by its sibling
+// in their parent's slot; the two nodes it leaves behind are unreachable.
+// Returns how many nodes went dead, for the caller to rebuild once enough
+// have.
+size_t remove_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+                  std::vector<cl_int>& indices, std::vector<cl_int>& parents,
+                  std::vector<cl_int>& leaves, cl_int instance,
+                  DirtyRanges& dirty_nodes, DirtyRanges& dirty_indices)
+{
+    cl_int n = leaves[instance];
+    BVHNode & leaf = nodes[n];
+    cl_int last = leaf.first + leaf.count - 1;
+    for (cl_int i = leaf.first; i <= last; i++) {
+        if (indices[i] == instance) {
+            indices[i] = indices[last];
+            dirty_indices.mark(i);
+            break;
+        }
+    }
+    leaf.count--;
+    leaves[instance] = -1;
+    dirty_nodes.mark(n);
+    if (leaf.count > 0) {
+        refit_bvh(bounds, nodes, indices, parents, n, dirty_nodes);
+        return 0;
+    }
+
+    cl_int parent = parents[n];
+    if (parent < 0) {
+        nodes.clear();
+        parents.clear();
+        return 1;
+    }
+    cl_int first = nodes[parent].first;
+    cl_int sibling = n == first ? first + 1 : first;
+    nodes[parent] = nodes[sibling];
+    const BVHNode & moved = nodes[parent];
+    if (moved.count > 0) {
+        for (cl_int i = moved.first; i < moved.first + moved.count; i++) {
+            leaves[indices[i]] = parent;
+        }
+    } else {
+        parents[moved.first] = parent;
+        parents[moved.first + 1] = parent;
+    }
+    dirty_nodes.mark(parent);
+    if (parents[parent] >= 0) {
+        refit_bvh(bounds, nodes, indices, parents, parents[parent], dirty_nodes);
+    }
+    return 2;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <vector>
+
+#include "DirtyRanges.hpp"
+#include "Primitives.hpp"
+
+// Deepest tree build_bvh produces; the kernel traversal stack is sized to
+// match (BVH_STACK_SIZE in primitives.h).
+const int bvh_max_depth = 64;
+const int bvh_leaf_size = 4;
+
+AABB instance_bounds(const Instance& instance, const AABB& bounds);
+void build_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+               std::vector<cl_int>& indices);
+void link_bvh(const std::vector<BVHNode>& nodes, const std::vector<cl_int>& indices,
+              std::vector<cl_int>& parents, std::vector<cl_int>& leaves);
+void refit_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+               const std::vector<cl_int>& indices, const std::vector<cl_int>& parents,
+               cl_int leaf, DirtyRanges& dirty);
+bool insert_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+                std::vector<cl_int>& indices, std::vector<cl_int>& parents,
+                std::vector<cl_int>& leaves, cl_int instance,
+                DirtyRanges& dirty_nodes, DirtyRanges& dirty_indices);
+size_t remove_bvh(const std::vector<AABB>& bounds, std::vector<BVHNode>& nodes,
+                  std::vector<cl_int>& indices, std::vector<cl_int>& parents,
+                  std::vector<cl_int>& leaves, cl_int instance,
+                  DirtyRanges& dirty_nodes, DirtyRanges& dirty_indices);
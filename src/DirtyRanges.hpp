@@ -0,0 +1,73 @@
+#pragma once
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#include <OpenCL/cl_platform.h>
+#elif defined __linux__
+#include <CL/cl.h>
+#include <CL/cl_platform.h>
+#endif
+
+#include "cl.hpp"
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Element ranges of a host mirror that changed since its last upload.
+// upload() merges overlapping and nearby ranges and writes them without
+// blocking, so the mirror must stay untouched until the queue has
+// finished, which Scene::update waits for before changing anything.
+class DirtyRanges {
+public:
+    // Ranges closer than this many elements are sent as one write.
+    static const size_t merge_gap = 16;
+
+    void mark(size_t first, size_t count = 1)
+    {
+        ranges.emplace_back(first, first + count);
+    }
+
+    bool empty() const
+    {
+        return ranges.empty();
+    }
+
+    const std::vector<std::pair<size_t, size_t>>& coalesce()
+    {
+        if (ranges.size() > 1) {
+            std::sort(ranges.begin(), ranges.end());
+            size_t last = 0;
+            for (size_t i = 1; i < ranges.size(); i++) {
+                if (ranges[i].first <= ranges[last].second + merge_gap) {
+                    ranges[last].second = std::max(ranges[last].second, ranges[i].second);
+                } else {
+                    ranges[++last] = ranges[i];
+                }
+            }
+            ranges.resize(last + 1);
+        }
+        return ranges;
+    }
+
+    // Returns the number of bytes written.
+    template<typename T>
+    size_t upload(cl::CommandQueue& queue, const cl::Buffer& buffer, const std::vector<T>& data)
+    {
+        size_t bytes = 0;
+        for (auto & range : coalesce()) {
+            size_t end = std::min(range.second, data.size());
+            if (range.first >= end) {
+                continue;
+            }
+            queue.enqueueWriteBuffer(buffer, CL_FALSE, sizeof(T) * range.first,
+                                     sizeof(T) * (end - range.first), &data[range.first]);
+            bytes += sizeof(T) * (end - range.first);
+        }
+        ranges.clear();
+        return bytes;
+    }
+
+private:
+    std::vector<std::pair<size_t, size_t>> ranges;
+};
@@ -0,0 +1,71 @@
+#include "FileWatcher.hpp"
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include <iostream>
+
+#ifdef __linux__
+static bool is_kernel_source(const std::string& name)
+{
+    auto ends_with = [&](const std::string& suffix) {
+        return name.size() > suffix.size()
+            && name.compare(name.size() - suffix.size(), suffix.size(), suffix) == 0;
+    };
+    return ends_with(".cl") || ends_with(".h");
+}
+
+FileWatcher::FileWatcher(const std::string& dir)
+    : fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC))
+{
+    if (fd < 0 || inotify_add_watch(fd, dir.c_str(),
+                                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+        std::cerr << "not watching " << dir << " for changes" << std::endl;
+    }
+}
+
+FileWatcher::~FileWatcher()
+{
+    if (fd >= 0) {
+        close(fd);
+    }
+}
+
+// Drains all pending events; editors that save through a temporary file
+// produce several per save.
+bool FileWatcher::changed()
+{
+    if (fd < 0) {
+        return false;
+    }
+    bool any = false;
+    alignas(inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (char* p = buffer; p < buffer + length; ) {
+            auto event = reinterpret_cast<inotify_event*>(p);
+            if (event->len && is_kernel_source(event->name)) {
+                any = true;
+            }
+            p += sizeof(inotify_event) + event->len;
+        }
+    }
+    return any;
+}
+#else
+FileWatcher::FileWatcher(const std::string&)
+    : fd(-1)
+{
+}
+
+FileWatcher::~FileWatcher()
+{
+}
+
+bool FileWatcher::changed()
+{
+    return false;
+}
+#endif
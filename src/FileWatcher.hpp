@@ -0,0 +1,18 @@
+#pragma once
+
+#include <string>
+
+// Reports changes to the kernel sources in a directory. Backed by inotify
+// on Linux, never reports anything elsewhere.
+class FileWatcher {
+public:
+    explicit FileWatcher(const std::string& dir);
+    ~FileWatcher();
+    FileWatcher(const FileWatcher&) = delete;
+    FileWatcher& operator=(const FileWatcher&) = delete;
+
+    bool changed();
+
+private:
+    int fd;
+};
@@ -3,6 +3,10 @@
 #include <boost/iostreams/device/mapped_file.hpp>
 #include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_transform.hpp>
 
 #include "iqm.h"
 
@@ -15,58 +19,346 @@ std::ostream& operator<<(std::ostream& strm, const Vertex& v)
 
 }
 
-Mesh load_mesh(std::string filename)
+static const iqmheader* iqm_header(const boost::iostreams::mapped_file_source& mesh_file,
+                                   const std::string& filename)
+{
+    const iqmheader* ih = reinterpret_cast<const iqmheader*>(mesh_file.data());
+    if (mesh_file.size() < sizeof(iqmheader)
+     || std::memcmp(ih->magic, IQM_MAGIC, sizeof(IQM_MAGIC)) != 0
+     || ih->version != IQM_VERSION
+     || ih->filesize > mesh_file.size()) {
+        throw std::runtime_error(filename + " is not an IQM v2 file");
+    }
+    return ih;
+}
+
+// Looks a vertex array up by its type, exporters are free to order and
+// interleave them however they like.
+static const iqmvertexarray* find_vertex_array(const char* data, const iqmheader* ih,
+                                               unsigned int type, unsigned int format,
+                                               unsigned int size, const std::string& filename)
+{
+    const size_t element = format == IQM_FLOAT ? sizeof(float) : sizeof(unsigned char);
+    if (ih->ofs_vertexarrays + sizeof(iqmvertexarray) * ih->num_vertexarrays > ih->filesize) {
+        throw std::runtime_error(filename + " has truncated vertex arrays");
+    }
+    auto arrays = reinterpret_cast<const iqmvertexarray*>(data + ih->ofs_vertexarrays);
+    for (unsigned int i = 0; i < ih->num_vertexarrays; i++) {
+        if (arrays[i].type != type) {
+            continue;
+        }
+        if (arrays[i].format != format || arrays[i].size != size
+         || arrays[i].offset + element * size * ih->num_vertexes > ih->filesize) {
+            throw std::runtime_error(filename + ": unsupported layout of vertex array "
+                                     + std::to_string(type));
+        }
+        return &arrays[i];
+    }
+    return nullptr;
+}
+
+MeshInfo mesh_info(const std::string& filename)
 {
     using namespace boost::iostreams;
 
     mapped_file_source mesh_file("../meshes/" + filename);
+    const iqmheader* ih = iqm_header(mesh_file, filename);
+    return { ih->num_vertexes, ih->num_triangles * 3 };
+}
 
-    const iqmheader* ih = reinterpret_cast<const iqmheader*>(mesh_file.data());
+// Fills slots sized by mesh_info straight from the mapped file and returns
+// the bounds of the positions. Missing normals and texcoords get defaults.
+AABB load_mesh(const std::string& filename, Vertex* vertices,
+               VertexAttributes* vertex_attributes, Indice* indices)
+{
+    using namespace boost::iostreams;
 
-    const iqmvertexarray* vaptr = reinterpret_cast<const iqmvertexarray*>(mesh_file.data() + ih->ofs_vertexarrays);
+    mapped_file_source mesh_file("../meshes/" + filename);
 
-    const iqmvertexarray* posva = vaptr;
-    const iqmvertexarray* uvva = vaptr + 1;
-    const iqmvertexarray* normalva = vaptr + 2;
+    const iqmheader* ih = iqm_header(mesh_file, filename);
+    const char* data = mesh_file.data();
 
-    Mesh mesh;
-    mesh.vertices.reserve(ih->num_vertexes);
-    mesh.indices.reserve(ih->num_triangles);
+    const iqmvertexarray* posva = find_vertex_array(data, ih, IQM_POSITION, IQM_FLOAT, 3, filename);
+    const iqmvertexarray* uvva = find_vertex_array(data, ih, IQM_TEXCOORD, IQM_FLOAT, 2, filename);
+    const iqmvertexarray* normalva = find_vertex_array(data, ih, IQM_NORMAL, IQM_FLOAT, 3, filename);
+    if (!posva) {
+        throw std::runtime_error(filename + " has no vertex positions");
+    }
 
     std::array<float, 3> min {{INFINITY, INFINITY, INFINITY}};
     std::array<float, 3> max {{-INFINITY, -INFINITY, -INFINITY}};
 
     auto positions = 
-        reinterpret_cast<const std::array<float, 3>*>(mesh_file.data() + posva->offset);
-    auto normals = 
-        reinterpret_cast<const std::array<float, 3>*>(mesh_file.data() + normalva->offset);
-    auto texcoords = 
-        reinterpret_cast<const std::array<float, 2>*>(mesh_file.data() + uvva->offset);
+        reinterpret_cast<const std::array<float, 3>*>(data + posva->offset);
+    auto normals = normalva
+        ? reinterpret_cast<const std::array<float, 3>*>(data + normalva->offset) : nullptr;
+    auto texcoords = uvva
+        ? reinterpret_cast<const std::array<float, 2>*>(data + uvva->offset) : nullptr;
 
     for(unsigned int i = 0; i < ih->num_vertexes; i++) {
         auto pos = positions[i];
-        auto nor = normals[i];
-        auto tc = texcoords[i];
-
+        auto nor = normals ? normals[i] : std::array<float, 3> {{0.0f, 0.0f, 1.0f}};
+        auto tc = texcoords ? texcoords[i] : std::array<float, 2> {{0.0f, 0.0f}};
 
         for (int j = 0; j < 3; j++) {
             min[j] = std::min(pos[j], min[j]);
             max[j] = std::max(pos[j], max[j]);
         }
 
-        mesh.vertices.emplace_back(pos);
-        mesh.vertexAttributes.emplace_back(nor, tc);
+        vertices[i] = Vertex(pos);
+        vertex_attributes[i] = VertexAttributes(nor, tc);
+    }
+
+    if (ih->ofs_triangles + sizeof(iqmtriangle) * ih->num_triangles > ih->filesize) {
+        throw std::runtime_error(filename + " has truncated triangles");
+    }
+    std::memcpy(indices, data + ih->ofs_triangles, sizeof(iqmtriangle) * ih->num_triangles);
+    for (size_t i = 0; i < (size_t)ih->num_triangles * 3; i++) {
+        if (indices[i] >= ih->num_vertexes) {
+            throw std::runtime_error(filename + " has a triangle outside its vertices");
+        }
+    }
+
+    AABB bounds;
+    bounds.min = {{min[0], min[1], min[2]}};
+    bounds.max = {{max[0], max[1], max[2]}};
+    return bounds;
+}
+
+static void check_range(const iqmheader* ih, unsigned int offset, size_t size,
+                        const std::string& filename)
+{
+    if (offset + size > ih->filesize) {
+        throw std::runtime_error(filename + " has a truncated skeleton");
+    }
+}
+
+static glm::mat4 joint_matrix(const glm::vec3& translate, const glm::quat& rotate,
+                              const glm::vec3& scale)
+{
+    return glm::translate(glm::mat4(1.0f), translate) * glm::mat4_cast(rotate)
+         * glm::scale(glm::mat4(1.0f), scale);
+}
+
+// Reads joints, animation frames and blend weights. Fills the bind pose of
+// every vertex into slots sized by mesh_info, with joint indexes local to
+// the skeleton; the caller places them.
+void load_skeleton(const std::string& filename, Skeleton& skeleton, SkinVertex* vertices)
+{
+    using namespace boost::iostreams;
+
+    mapped_file_source mesh_file("../meshes/" + filename);
+
+    const iqmheader* ih = iqm_header(mesh_file, filename);
+    const char* data = mesh_file.data();
+    if (ih->num_joints == 0 || ih->num_anims == 0 || ih->num_poses != ih->num_joints) {
+        throw std::runtime_error(filename + " has no animated skeleton");
+    }
+    check_range(ih, ih->ofs_text, ih->num_text, filename);
+    check_range(ih, ih->ofs_joints, sizeof(iqmjoint) * ih->num_joints, filename);
+    check_range(ih, ih->ofs_poses, sizeof(iqmpose) * ih->num_poses, filename);
+    check_range(ih, ih->ofs_anims, sizeof(iqmanim) * ih->num_anims, filename);
+    check_range(ih, ih->ofs_frames,
+                sizeof(unsigned short) * ih->num_frames * ih->num_framechannels, filename);
+
+    const char* text = data + ih->ofs_text;
+    auto name = [&](unsigned int offset) {
+        if (offset >= ih->num_text) {
+            throw std::runtime_error(filename + " has a bad name offset");
+        }
+        return std::string(text + offset, strnlen(text + offset, ih->num_text - offset));
+    };
+
+    auto joints = reinterpret_cast<const iqmjoint*>(data + ih->ofs_joints);
+    std::vector<glm::mat4> bind(ih->num_joints);
+    skeleton.parents.resize(ih->num_joints);
+    skeleton.inverse_bind.resize(ih->num_joints);
+    for (unsigned int j = 0; j < ih->num_joints; j++) {
+        const iqmjoint & joint = joints[j];
+        if (joint.parent >= (int)j) {
+            throw std::runtime_error(filename + " lists a joint before its parent");
+        }
+        glm::mat4 local = joint_matrix(
+            glm::vec3(joint.translate[0], joint.translate[1], joint.translate[2]),
+            glm::normalize(glm::quat(joint.rotate[3], joint.rotate[0],
+                                     joint.rotate[1], joint.rotate[2])),
+            glm::vec3(joint.scale[0], joint.scale[1], joint.scale[2]));
+        bind[j] = joint.parent >= 0 ? bind[joint.parent] * local : local;
+        skeleton.parents[j] = joint.parent;
+        skeleton.inverse_bind[j] = glm::inverse(bind[j]);
     }
 
-    auto triangles = reinterpret_cast<const unsigned int*>(mesh_file.data() + ih->ofs_triangles);
-    for(unsigned int i = 0; i < ih->num_triangles * 3; i++) {
-        auto t = triangles[i];
-        mesh.indices.emplace_back(t);
+    // Channels not flagged in a pose's mask are constant and stored only as
+    // the offset; the rest are unorm16 values read in order from the frame.
+    auto poses = reinterpret_cast<const iqmpose*>(data + ih->ofs_poses);
+    unsigned int masked_channels = 0;
+    for (unsigned int p = 0; p < ih->num_poses; p++) {
+        for (int c = 0; c < 10; c++) {
+            masked_channels += (poses[p].mask >> c) & 1u;
+        }
+    }
+    if (masked_channels != ih->num_framechannels) {
+        throw std::runtime_error(filename + " has frames that do not match its poses");
+    }
+    auto frame_data = reinterpret_cast<const unsigned short*>(data + ih->ofs_frames);
+    skeleton.frames.resize((size_t)ih->num_frames * ih->num_poses);
+    for (unsigned int f = 0; f < ih->num_frames; f++) {
+        for (unsigned int p = 0; p < ih->num_poses; p++) {
+            const iqmpose & pose = poses[p];
+            float channel[10];
+            for (int c = 0; c < 10; c++) {
+                channel[c] = pose.channeloffset[c];
+                if (pose.mask & (1u << c)) {
+                    channel[c] += *frame_data++ * pose.channelscale[c];
+                }
+            }
+            JointPose & jp = skeleton.frames[(size_t)f * ih->num_poses + p];
+            jp.translate = glm::vec3(channel[0], channel[1], channel[2]);
+            jp.rotate = glm::normalize(glm::quat(channel[6], channel[3], channel[4], channel[5]));
+            jp.scale = glm::vec3(channel[7], channel[8], channel[9]);
+        }
+    }
+
+    auto anims = reinterpret_cast<const iqmanim*>(data + ih->ofs_anims);
+    for (unsigned int a = 0; a < ih->num_anims; a++) {
+        const iqmanim & anim = anims[a];
+        if (anim.num_frames == 0 || anim.first_frame + anim.num_frames > ih->num_frames) {
+            throw std::runtime_error(filename + " has an animation outside its frames");
+        }
+        skeleton.animations.push_back({ name(anim.name), anim.first_frame, anim.num_frames,
+                                        anim.framerate, (anim.flags & IQM_LOOP) != 0 });
     }
-    
-    mesh.bounds.min = {{min[0], min[1], min[2]}};
-    mesh.bounds.max = {{max[0], max[1], max[2]}};
 
-    return mesh;
+    const iqmvertexarray* posva = find_vertex_array(data, ih, IQM_POSITION, IQM_FLOAT, 3, filename);
+    const iqmvertexarray* normalva = find_vertex_array(data, ih, IQM_NORMAL, IQM_FLOAT, 3, filename);
+    const iqmvertexarray* indexva = find_vertex_array(data, ih, IQM_BLENDINDEXES, IQM_UBYTE, 4, filename);
+    const iqmvertexarray* weightva = find_vertex_array(data, ih, IQM_BLENDWEIGHTS, IQM_UBYTE, 4, filename);
+    if (!posva || !indexva || !weightva) {
+        throw std::runtime_error(filename + " has no blend weights");
+    }
+    auto positions = reinterpret_cast<const std::array<float, 3>*>(data + posva->offset);
+    auto normals = normalva
+        ? reinterpret_cast<const std::array<float, 3>*>(data + normalva->offset) : nullptr;
+    auto blend_indexes = reinterpret_cast<const unsigned char*>(data + indexva->offset);
+    auto blend_weights = reinterpret_cast<const unsigned char*>(data + weightva->offset);
+
+    AABB empty;
+    empty.min = {{INFINITY, INFINITY, INFINITY}};
+    empty.max = {{-INFINITY, -INFINITY, -INFINITY}};
+    skeleton.joint_bounds.assign(ih->num_joints, empty);
+    skeleton.unskinned_bounds = empty;
+    auto grow = [](AABB& bounds, const cl_float3& p) {
+        for (int j = 0; j < 3; j++) {
+            bounds.min.s[j] = std::min(bounds.min.s[j], p.s[j]);
+            bounds.max.s[j] = std::max(bounds.max.s[j], p.s[j]);
+        }
+    };
+
+    for (unsigned int i = 0; i < ih->num_vertexes; i++) {
+        SkinVertex & v = vertices[i];
+        auto pos = positions[i];
+        auto nor = normals ? normals[i] : std::array<float, 3> {{0.0f, 0.0f, 1.0f}};
+        v.position = {{pos[0], pos[1], pos[2]}};
+        v.normal = {{nor[0], nor[1], nor[2]}};
+        v.target = -1;
+        bool weighted = false;
+        for (int k = 0; k < 4; k++) {
+            unsigned char joint = blend_indexes[i * 4 + k];
+            unsigned char weight = blend_weights[i * 4 + k];
+            if (joint >= ih->num_joints) {
+                throw std::runtime_error(filename + " blends a joint it does not have");
+            }
+            v.joints.s[k] = joint;
+            v.weights.s[k] = weight;
+            if (weight > 0) {
+                grow(skeleton.joint_bounds[joint], v.position);
+                weighted = true;
+            }
+        }
+        if (!weighted) {
+            grow(skeleton.unskinned_bounds, v.position);
+        }
+    }
 }
 
+void precompute_triangles(const Vertex* vertices, const Indice* indices,
+                          size_t num_indices, PrecomputedTriangle* triangles)
+{
+    for (size_t i = 0; i + 2 < num_indices; i += 3) {
+        auto & a = vertices[indices[i]].position;
+        auto & b = vertices[indices[i + 1]].position;
+        auto & c = vertices[indices[i + 2]].position;
+        PrecomputedTriangle & triangle = triangles[i / 3];
+        triangle.v0 = a;
+        triangle.e1 = {{ b.s[0] - a.s[0], b.s[1] - a.s[1], b.s[2] - a.s[2] }};
+        triangle.e2 = {{ c.s[0] - a.s[0], c.s[1] - a.s[1], c.s[2] - a.s[2] }};
+    }
+}
+
+// Quantizes positions to 16 bits per axis against the mesh bounds.
+// Indexed vertices are shared, so the mesh stays watertight; what can
+// break is triangles whose corners collapse onto the same grid point.
+QuantizationReport quantize_positions(const Vertex* vertices, size_t num_vertices,
+                                      const Indice* indices, size_t num_indices,
+                                      const AABB& bounds, QuantizedVertex* quantized)
+{
+    QuantizationReport report = {0.0f, 0.0f, 0};
+
+    float diagonal = 0.0f;
+    for (int j = 0; j < 3; j++) {
+        float extent = bounds.max.s[j] - bounds.min.s[j];
+        diagonal += extent * extent;
+    }
+    diagonal = std::sqrt(diagonal);
+
+    for (size_t i = 0; i < num_vertices; i++) {
+        auto & vertex = vertices[i];
+        QuantizedVertex & q = quantized[i];
+        q.position.s[3] = 0;
+        float error = 0.0f;
+        for (int j = 0; j < 3; j++) {
+            float min = bounds.min.s[j];
+            float extent = bounds.max.s[j] - min;
+            float t = extent > 0.0f ? (vertex.position.s[j] - min) / extent : 0.0f;
+            q.position.s[j] = (cl_ushort)std::lround(std::min(std::max(t, 0.0f), 1.0f) * 65535.0f);
+            float d = min + q.position.s[j] / 65535.0f * extent - vertex.position.s[j];
+            error += d * d;
+        }
+        report.max_error = std::max(report.max_error, std::sqrt(error));
+    }
+    report.relative_error = diagonal > 0.0f ? report.max_error / diagonal : 0.0f;
+
+    auto same = [&](Indice a, Indice b) {
+        auto & p = quantized[a].position;
+        auto & q = quantized[b].position;
+        return p.s[0] == q.s[0] && p.s[1] == q.s[1] && p.s[2] == q.s[2];
+    };
+    auto same_float = [&](Indice a, Indice b) {
+        auto & p = vertices[a].position;
+        auto & q = vertices[b].position;
+        return p.s[0] == q.s[0] && p.s[1] == q.s[1] && p.s[2] == q.s[2];
+    };
+    for (size_t i = 0; i + 2 < num_indices; i += 3) {
+        Indice a = indices[i], b = indices[i + 1], c = indices[i + 2];
+        bool collapsed = same(a, b) || same(b, c) || same(a, c);
+        bool degenerate = same_float(a, b) || same_float(b, c) || same_float(a, c);
+        if (collapsed && !degenerate) {
+            report.collapsed_triangles++;
+        }
+    }
+    return report;
+}
+
+// Rewrites positions to what the kernel reconstructs from the quantized
+// ones, so precomputed triangles match the vertices the device sees.
+void dequantize_positions(const QuantizedVertex* quantized, size_t num_vertices,
+                          const AABB& bounds, Vertex* vertices)
+{
+    for (size_t i = 0; i < num_vertices; i++) {
+        for (int j = 0; j < 3; j++) {
+            float min = bounds.min.s[j];
+            float extent = bounds.max.s[j] - min;
+            vertices[i].position.s[j] = min + quantized[i].position.s[j] / 65535.0f * extent;
+        }
+    }
+}
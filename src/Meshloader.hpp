@@ -14,5 +14,27 @@
 #include <tuple>
 
 #include "Primitives.hpp"
+#include "Skinning.hpp"
 
-Mesh load_mesh(std::string filename);
+struct QuantizationReport {
+    float max_error;
+    float relative_error;
+    unsigned int collapsed_triangles;
+};
+
+struct MeshInfo {
+    unsigned int num_vertices;
+    unsigned int num_indices;
+};
+
+MeshInfo mesh_info(const std::string& filename);
+AABB load_mesh(const std::string& filename, Vertex* vertices,
+               VertexAttributes* vertex_attributes, Indice* indices);
+void load_skeleton(const std::string& filename, Skeleton& skeleton, SkinVertex* vertices);
+void precompute_triangles(const Vertex* vertices, const Indice* indices,
+                          size_t num_indices, PrecomputedTriangle* triangles);
+QuantizationReport quantize_positions(const Vertex* vertices, size_t num_vertices,
+                                      const Indice* indices, size_t num_indices,
+                                      const AABB& bounds, QuantizedVertex* quantized);
+void dequantize_positions(const QuantizedVertex* quantized, size_t num_vertices,
+                          const AABB& bounds, Vertex* vertices);
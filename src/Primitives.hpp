@@ -15,6 +15,8 @@
 #include "cl.hpp"
 #include <vector>
 #include <array>
+#include <cmath>
+#include <glm/gtc/packing.hpp>
 #include <glm/gtc/quaternion.hpp>
 
 struct Light {
@@ -27,25 +29,49 @@ struct Material {
     cl_int diffuse;
     cl_float fresnel0;
     cl_float roughness;
+    cl_float2 uv_offset;
+    cl_float2 uv_scale;
 };
 
 struct Vertex {
     cl_float3 position;
 
+    Vertex () {}
     Vertex (std::array<float, 3> & p)
         : position{{p[0], p[1], p[2]}}
     {}
 };
 
+// Position as unorm16 relative to the bounds of its mesh.
+struct QuantizedVertex {
+    cl_ushort4 position;
+};
+
+// Normal as an octahedral mapped snorm16 pair, texcoord as two halfs.
 struct VertexAttributes {
-    cl_float3 normal;
-    cl_float2 texcoord;
+    cl_uint normal;
+    cl_uint texcoord;
 
+    VertexAttributes () {}
     VertexAttributes (std::array<float, 3> & n,
                       std::array<float, 2> & t)
-        : normal{{n[0], n[1], n[2]}}
-        , texcoord{{t[0], t[1]}}
+        : normal(encode_normal(n))
+        , texcoord(glm::packHalf2x16(glm::vec2(t[0], t[1])))
     {}
+
+    static cl_uint encode_normal(const std::array<float, 3> & n)
+    {
+        float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+        float x = n[0] / l1;
+        float y = n[1] / l1;
+        if (n[2] < 0.0f) {
+            float ox = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+            float oy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+            x = ox;
+            y = oy;
+        }
+        return glm::packSnorm2x16(glm::vec2(x, y));
+    }
 };
 
 typedef cl_uint Indice;
@@ -55,6 +81,12 @@ struct AABB {
     cl_float3 max;
 };
 
+struct PrecomputedTriangle {
+    cl_float3 v0;
+    cl_float3 e1;
+    cl_float3 e2;
+};
+
 struct Mesh {
     std::vector<Vertex> vertices;
     std::vector<VertexAttributes> vertexAttributes;
@@ -62,21 +94,58 @@ struct Mesh {
     AABB bounds;
 };
 
-struct CLMesh {
+// Placement of one copy of a geometry. Scale is uniform to keep the
+// record at three 16 byte rows.
+struct Instance {
     glm::quat orientation;
     cl_float3 position;
-    cl_float3 scale;
-
-    cl_int num_indices;
+    cl_float scale;
+    cl_int geometry;
     cl_int material;
+    cl_uint revision;
+};
 
+// Range of the scene-wide vertex and index arrays holding one mesh file,
+// and the geometry shadow rays test in its place.
+struct CLGeometry {
     cl_int base_vertex;
     cl_int base_indice;
+    cl_int num_indices;
+    cl_int shadow;
+    AABB bounds;
 };
 
+// Top level BVH node. Interior nodes have count 0 and their children at
+// first and first + 1, leaves cover count entries of the instance index
+// array starting at first.
 struct BVHNode {
     AABB bounds;
-    cl_float3 position;
-    cl_float3 scale;
-    cl_int mesh;
+    cl_int first;
+    cl_int count;
+};
+
+struct Reservoir {
+    cl_int light;
+    cl_float weight_sum;
+    cl_float count;
+    cl_float weight;
+    cl_float depth;
+};
+
+struct RayStats {
+    cl_uint rays;
+    cl_uint roulette;
+    cl_uint budget_exhausted;
+    cl_uint misses;
+    cl_uint path_lengths[16];
+};
+
+struct OccluderCacheEntry {
+    cl_int light;
+    cl_int receiver;
+    cl_int receiver_mesh;
+    cl_int occluder;
+    cl_int occluder_mesh;
+    cl_uint receiver_revision;
+    cl_uint occluder_revision;
 };
@@ -0,0 +1,255 @@
+#include "ProgramBuilder.hpp"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+#include "Utils.hpp"
+
+ProgramBuilder::ProgramBuilder(cl::Context context, cl::Device device,
+                               const std::string& kernels_dir,
+                               const std::vector<std::string>& filenames)
+    : context(context)
+    , device(device)
+    , kernels_dir(kernels_dir)
+    , filenames(filenames)
+    , generation(0)
+    , stopping(false)
+    , worker(&ProgramBuilder::work, this)
+{
+}
+
+ProgramBuilder::~ProgramBuilder()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    worker.join();
+}
+
+// Waits for a build of the same options already running on the worker
+// and takes its program if it succeeded.
+cl::Program ProgramBuilder::build(const std::string& options)
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    finished.wait(lock, [&] { return !building.count(options); });
+    auto it = programs.find(options);
+    if (it != programs.end()) {
+        return it->second;
+    }
+    building.insert(options);
+    lock.unlock();
+
+    cl::Program program;
+    try {
+        program = compile(options);
+    } catch (std::exception& err) {
+        lock.lock();
+        building.erase(options);
+        failed[options] = err.what();
+        finished.notify_all();
+        throw;
+    }
+    lock.lock();
+    building.erase(options);
+    failed.erase(options);
+    programs[options] = program;
+    finished.notify_all();
+    return program;
+}
+
+void ProgramBuilder::request(const std::string& options)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (programs.count(options) || failed.count(options) || building.count(options)
+         || std::find(requests.begin(), requests.end(), options) != requests.end()) {
+            return;
+        }
+        requests.push_back(options);
+    }
+    wake.notify_one();
+}
+
+bool ProgramBuilder::ready(const std::string& options, cl::Program& program)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = programs.find(options);
+    if (it == programs.end()) {
+        return false;
+    }
+    program = it->second;
+    return true;
+}
+
+// Drops finished, failed and queued programs after the sources changed. A
+// build still running on the worker is discarded when it finishes.
+void ProgramBuilder::clear()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    programs.clear();
+    failed.clear();
+    requests.clear();
+    generation++;
+}
+
+// Log of the last failed build of these options, empty unless it failed.
+std::string ProgramBuilder::error_log(const std::string& options)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = failed.find(options);
+    return it != failed.end() ? it->second : std::string();
+}
+
+cl::Program ProgramBuilder::compile(const std::string& options)
+{
+    std::vector<std::string> sources;
+    for (auto & flnm : filenames) {
+        sources.push_back(file_to_str(kernels_dir + flnm));
+    }
+    return build_program(context, device, sources, read_headers(kernels_dir), options);
+}
+
+void ProgramBuilder::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+        wake.wait(lock, [this] { return stopping || !requests.empty(); });
+        if (stopping) {
+            return;
+        }
+        std::string options = requests.front();
+        requests.pop_front();
+        if (programs.count(options) || failed.count(options) || building.count(options)) {
+            continue;
+        }
+        building.insert(options);
+        unsigned int started = generation;
+
+        lock.unlock();
+        cl::Program program;
+        std::string log;
+        bool built = true;
+        try {
+            program = compile(options);
+        } catch (std::exception& err) {
+            log = err.what();
+            built = false;
+        }
+        lock.lock();
+
+        building.erase(options);
+        finished.notify_all();
+        if (generation != started) {
+            continue;
+        }
+        if (built) {
+            programs[options] = program;
+        } else {
+            failed[options] = log;
+        }
+    }
+}
+
+// Contents of every header in dir, for keying the binary cache.
+std::string read_headers(const std::string& dir)
+{
+    std::vector<std::string> names;
+    if (DIR* d = opendir(dir.c_str())) {
+        while (dirent* entry = readdir(d)) {
+            std::string name = entry->d_name;
+            if (name.size() > 2 && name.compare(name.size() - 2, 2, ".h") == 0) {
+                names.push_back(name);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(names.begin(), names.end());
+
+    std::string headers;
+    for (auto & name : names) {
+        headers += name + file_to_str(dir + name);
+    }
+    return headers;
+}
+
+// Built programs are kept as device binaries in the working directory.
+// The key is the sources, the headers they include, the build options and
+// the device and driver; files are named by its FNV-1a digest and start
+// with the key itself, so a collision reads as a miss. Any failure to
+// load or build a cached binary falls back to a source build, which then
+// replaces the cache entry.
+cl::Program build_program(cl::Context context, cl::Device device,
+                          const std::vector<std::string>& sources,
+                          const std::string& headers,
+                          const std::string& options)
+{
+    std::string key = options + '\0'
+                    + device.getInfo<CL_DEVICE_NAME>() + '\0'
+                    + device.getInfo<CL_DEVICE_VERSION>() + '\0'
+                    + device.getInfo<CL_DRIVER_VERSION>() + '\0'
+                    + headers;
+    for (auto & src : sources) {
+        key += '\0' + src;
+    }
+    std::stringstream cache_filename;
+    cache_filename << "kernelcache-" << std::hex << std::setfill('0') << std::setw(16)
+                   << fnv1a(key.data(), key.size()) << ".bin";
+
+    std::ifstream cached(cache_filename.str(), std::ios::binary);
+    if (cached) {
+        std::vector<char> contents((std::istreambuf_iterator<char>(cached)),
+                                   std::istreambuf_iterator<char>());
+        uint64_t key_size = 0;
+        if (contents.size() >= sizeof(key_size)) {
+            std::copy_n(contents.data(), sizeof(key_size), reinterpret_cast<char*>(&key_size));
+        }
+        const size_t header_size = sizeof(key_size) + key.size();
+        try {
+            if (key_size != key.size() || contents.size() <= header_size
+             || key.compare(0, key.size(), contents.data() + sizeof(key_size), key.size()) != 0) {
+                throw std::runtime_error("cache key mismatch");
+            }
+            cl::Program program(context, {device},
+                                {{contents.data() + header_size, contents.size() - header_size}});
+            program.build({device}, options.c_str());
+            return program;
+        } catch (std::exception& err) {
+            std::cerr << "discarding " << cache_filename.str() << std::endl;
+        }
+    }
+
+    cl::Program::Sources cl_sources;
+    for (auto & src : sources) {
+        cl_sources.push_back({src.c_str(), src.length()});
+    }
+    cl::Program program(context, cl_sources);
+    try {
+        program.build({device}, options.c_str());
+    } catch (cl::Error err) {
+        auto log = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        std::cerr << "error building: " << log << std::endl;
+        throw BuildError(log);
+    }
+
+    auto sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+    auto binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+    if (!sizes.empty() && sizes[0] > 0) {
+        std::ofstream out(cache_filename.str(), std::ios::binary | std::ios::trunc);
+        uint64_t key_size = key.size();
+        out.write(reinterpret_cast<const char*>(&key_size), sizeof(key_size));
+        out.write(key.data(), key.size());
+        out.write(binaries[0], sizes[0]);
+    }
+    for (auto binary : binaries) {
+        delete[] binary;
+    }
+    return program;
+}
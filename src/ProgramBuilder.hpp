@@ -0,0 +1,72 @@
+#pragma once
+
+#define __CL_ENABLE_EXCEPTIONS
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#elif defined __linux__
+#include <CL/cl.h>
+#endif
+
+#include "cl.hpp"
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Thrown with the compiler's log when a program fails to build.
+struct BuildError : std::runtime_error {
+    explicit BuildError(const std::string& log)
+        : std::runtime_error(log)
+    {}
+};
+
+// Builds kernel programs by option string, either right away or on a
+// worker thread, and keeps every finished program so switching back to a
+// variant is free. Options that failed to build keep their log and are
+// not requested again until clear(), and one option string is never built
+// twice at once.
+class ProgramBuilder {
+public:
+    ProgramBuilder(cl::Context context, cl::Device device,
+                   const std::string& kernels_dir,
+                   const std::vector<std::string>& filenames);
+    ~ProgramBuilder();
+
+    cl::Program build(const std::string& options);
+    void request(const std::string& options);
+    bool ready(const std::string& options, cl::Program& program);
+    void clear();
+    std::string error_log(const std::string& options);
+
+private:
+    cl::Context context;
+    cl::Device device;
+    std::string kernels_dir;
+    std::vector<std::string> filenames;
+
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    std::deque<std::string> requests;
+    std::map<std::string, cl::Program> programs;
+    std::map<std::string, std::string> failed;
+    std::set<std::string> building;
+    unsigned int generation;
+    bool stopping;
+    std::thread worker;
+
+    cl::Program compile(const std::string& options);
+    void work();
+};
+
+std::string read_headers(const std::string& dir);
+cl::Program build_program(cl::Context context, cl::Device device,
+                          const std::vector<std::string>& sources,
+                          const std::string& headers,
+                          const std::string& options);
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <map>
+
+// First fit sub-allocator over the elements of a growable buffer. Freed
+// ranges merge with their free neighbours; when none is large enough the
+// range goes at the end and size() grows, which the owner follows by
+// growing the buffer.
+class RangeAllocator {
+public:
+    explicit RangeAllocator(size_t used = 0)
+        : end(used)
+    {}
+
+    size_t allocate(size_t count)
+    {
+        for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+            if (it->second < count) {
+                continue;
+            }
+            size_t first = it->first;
+            size_t rest = it->second - count;
+            free_ranges.erase(it);
+            if (rest > 0) {
+                free_ranges[first + count] = rest;
+            }
+            return first;
+        }
+        size_t first = end;
+        end += count;
+        return first;
+    }
+
+    void free(size_t first, size_t count)
+    {
+        if (count == 0) {
+            return;
+        }
+        auto next = free_ranges.lower_bound(first);
+        if (next != free_ranges.end() && first + count == next->first) {
+            count += next->second;
+            next = free_ranges.erase(next);
+        }
+        if (next != free_ranges.begin()) {
+            auto previous = std::prev(next);
+            if (previous->first + previous->second == first) {
+                first = previous->first;
+                count += previous->second;
+                free_ranges.erase(previous);
+            }
+        }
+        if (first + count == end) {
+            end = first;
+        } else {
+            free_ranges[first] = count;
+        }
+    }
+
+    // One past the last element ever handed out and not freed from the end.
+    size_t size() const
+    {
+        return end;
+    }
+
+private:
+    std::map<size_t, size_t> free_ranges;
+    size_t end;
+};
@@ -9,7 +9,8 @@
 #include <GLFW/glfw3.h>
 
 Rasterizer::Rasterizer()
-    : framebuffer(0)
+    : bound_layout(0)
+    , framebuffer(0)
     , color_renderbuffer(0)
     , depth_renderbuffer(0)
 {
@@ -28,16 +29,21 @@ void Rasterizer::load_shaders()
 void Rasterizer::set_scene(const Scene& scene)
 {
     current_scene = &scene;
+    bound_layout = scene.layout_revision;
 
     glBindVertexArray(vao);
     glBindBuffer(GL_ARRAY_BUFFER, scene.glview.vertexBuffer);
     glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
+    if (scene.quantized_positions) {
+        glVertexAttribPointer(0, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(QuantizedVertex), nullptr);
+    } else {
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), nullptr);
+    }
     glBindBuffer(GL_ARRAY_BUFFER, scene.glview.vertexAttributesBuffer);
     glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(VertexAttributes), nullptr);
+    glVertexAttribPointer(1, 2, GL_SHORT, GL_TRUE, sizeof(VertexAttributes), nullptr);
     glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexAttributes), 
+    glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, sizeof(VertexAttributes), 
                           (void*)offsetof(struct VertexAttributes, texcoord));
 }
 
@@ -78,6 +84,9 @@ void Rasterizer::set_texture(GLuint texture, int width, int height)
 
 void Rasterizer::render()
 {
+    if (current_scene->layout_revision != bound_layout) {
+        set_scene(*current_scene);
+    }
     glBindVertexArray(vao);
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, 0);
@@ -106,6 +115,8 @@ void Rasterizer::render()
     auto translationAttrib = glGetUniformLocation(shader, "translation");
     auto scaleAttrib = glGetUniformLocation(shader, "scale");
     auto perspMatAttrib = glGetUniformLocation(shader, "perspMat");
+    auto boundsMinAttrib = glGetUniformLocation(shader, "boundsMin");
+    auto boundsExtentAttrib = glGetUniformLocation(shader, "boundsExtent");
 
     auto perspMat = glm::perspective(glm::radians(80.0f), (float)width/height, 0.5f, 500.0f)
                   * glm::lookAt(glm::vec3(0.0f, 0.0f, 0.0f),
@@ -114,14 +125,25 @@ void Rasterizer::render()
 
     glUniformMatrix4fv(perspMatAttrib, 1, GL_FALSE, glm::value_ptr(perspMat));
 
-    for (auto & mesh : current_scene->clmeshes) {
-        auto rotMat = glm::mat4_cast(mesh.orientation);
+    for (auto & instance : current_scene->instances) {
+        auto & geometry = current_scene->clgeometries[instance.geometry];
+        auto rotMat = glm::mat4_cast(instance.orientation);
         glUniformMatrix4fv(orientationAttrib, 1, GL_FALSE, glm::value_ptr(rotMat));
-        glUniform3fv(translationAttrib, 1, (GLfloat*)&mesh.position);
-        glUniform3fv(scaleAttrib, 1, (GLfloat*)&mesh.scale);
-        glDrawElementsBaseVertex(GL_TRIANGLES, mesh.num_indices,
-                                 GL_UNSIGNED_INT, (void*)mesh.base_indice,
-                                 mesh.base_vertex);
+        glUniform3fv(translationAttrib, 1, (GLfloat*)&instance.position);
+        glUniform3f(scaleAttrib, instance.scale, instance.scale, instance.scale);
+        if (current_scene->quantized_positions) {
+            glUniform3f(boundsMinAttrib, geometry.bounds.min.s[0],
+                        geometry.bounds.min.s[1], geometry.bounds.min.s[2]);
+            glUniform3f(boundsExtentAttrib, geometry.bounds.max.s[0] - geometry.bounds.min.s[0],
+                        geometry.bounds.max.s[1] - geometry.bounds.min.s[1],
+                        geometry.bounds.max.s[2] - geometry.bounds.min.s[2]);
+        } else {
+            glUniform3f(boundsMinAttrib, 0.0f, 0.0f, 0.0f);
+            glUniform3f(boundsExtentAttrib, 1.0f, 1.0f, 1.0f);
+        }
+        glDrawElementsBaseVertex(GL_TRIANGLES, geometry.num_indices,
+                                 GL_UNSIGNED_INT, (void*)(sizeof(Indice) * geometry.base_indice),
+                                 geometry.base_vertex);
     }
     glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
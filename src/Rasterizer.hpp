@@ -23,6 +23,7 @@ private:
     options current_options;
 
     const Scene* current_scene;
+    cl_uint bound_layout;
     const std::string shaders_dir = "../src/shaders/";
     const std::array<std::string, 2> shader_filenames = {{ "simple.vert",
                                                            "simple.frag" }};
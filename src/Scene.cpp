@@ -1,149 +1,1190 @@
 #include "Scene.hpp"
+#include "BVH.hpp"
 #include "Meshloader.hpp"
+#include "ScenePackage.hpp"
+#include "Simplify.hpp"
+#include "Textures.hpp"
+#include "ThreadPool.hpp"
+#include "Utils.hpp"
 
 #include "GLFW/glfw3.h"
 #include "yaml-cpp/yaml.h"
 
-#include "lodepng.h"
 #include <glm/gtc/quaternion.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
+#include <boost/iostreams/device/mapped_file.hpp>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <functional>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <random>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <type_traits>
 #include <vector>
 
 Scene::Scene(cl::Context context, cl::Device device, cl::CommandQueue queue)
-    : context(context)
+    : compressed_textures(false)
+    , quantized_positions(false)
+    , precomputed_triangles(false)
+    , virtual_textures(false)
+    , lod_size(0.05f)
+    , selected_triangles(0)
+    , uploaded_bytes(0)
+    , layout_revision(0)
+    , cache_tiles(0)
+    , context(context)
     , device(device)
     , queue(queue)
+    , vertex_capacity(0)
+    , indice_capacity(0)
+    , instance_capacity(0)
+    , geometry_capacity(0)
+    , bvh_capacity(0)
+    , bvh_instance_capacity(0)
+    , bvh_dead_nodes(0)
 {
 }
 
 void Scene::update()
 {
-    float x = fmod((glfwGetTime() * 0.7), 2 * M_PI);
-    //spheres[0].center.s[0] = 0.f - std::sin(x - M_PI) * 30;
-    //spheres[0].center.s[1] = 0.0f - std::sin(x - M_PI / 2) * 30;
-    //spheres[1].center.s[0] = 0.f - std::sin(x - M_PI) * 40;
-    ////cl::copy(spheres.begin(), spheres.end(), spheresBuffer);
-    //queue.enqueueWriteBuffer(spheresBuffer, CL_TRUE, 0,
-    //                         sizeof(Sphere) * spheres.size(), spheres.data());
-
-    lights[0].location.x = std::cos(x - M_PI / 2) * 25;
-    //lights[0].location.y = std::sin(x - M_PI) * 22;
-    lights[0].location.z = -90.f - std::cos(x - M_PI) * 25;
-    //cl::copy(lights.begin(), lights.end(), lightsBuffer);
-    //queue.enqueueWriteBuffer(clview.lightsBuffer, CL_TRUE, 0,
-    //                         sizeof(Light) * lights.size(), lights.data());
-    clmeshes[0].orientation = 
-        glm::angleAxis((float)std::sin(x - M_PI) * 2, glm::vec3(0.0f, 1.0f, 0.0f));
-    clmeshes[1].position.z =
-        -110.0f + (float)std::sin(x - M_PI) * 20;
-
-    queue.enqueueWriteBuffer(clview.meshesBuffer, CL_TRUE, 0,
-                             sizeof(CLMesh) * clmeshes.size(), clmeshes.data());
+    // Last frame's uploads read straight from the host mirrors, which are
+    // about to change. Tracer::render finishes the queue anyway, but the
+    // rasterizer does not.
+    queue.finish();
+    float time = (float)glfwGetTime();
+    animator.evaluate(time, graph, lights, dirty_lights);
+    graph.update(instances, dirty_instances);
+    size_t joint_bytes = 0;
+    if (skinner) {
+        pose_skins(time);
+        joint_bytes = skinner->skin(joint_transforms, clview.vertexBuffer,
+                                    clview.vertexAttributesBuffer, clview.indicesBuffer,
+                                    precomputed_triangles ? &clview.trianglesBuffer : nullptr);
+    }
+    if (virtual_diffuse) {
+        virtual_diffuse->update();
+    }
+
+    upload_changes();
+    uploaded_bytes += joint_bytes;
+}
+
+// Picks the level of an instance from the angle its bounds cover as seen
+// from the camera at the origin, one level coarser every time that angle
+// halves below lod_size. Levels share their bounds, so the BVH is not
+// touched; the revision bump drops cached occluders on the old level.
+void Scene::select_lod(size_t i)
+{
+    Instance & instance = instances[i];
+    cl_int base = geometries[instance.geometry].lod_base;
+    if (geometries[base].lod_next < 0) {
+        return;
+    }
+    const AABB & bounds = world_bounds[i];
+    float center = 0.0f;
+    float radius = 0.0f;
+    for (int j = 0; j < 3; j++) {
+        float c = (bounds.min.s[j] + bounds.max.s[j]) * 0.5f;
+        float e = (bounds.max.s[j] - bounds.min.s[j]) * 0.5f;
+        center += c * c;
+        radius += e * e;
+    }
+    float size = std::sqrt(radius / std::max(center, radius));
+    int level = size >= lod_size ? 0 : 1 + (int)std::log2(lod_size / size);
+    cl_int g = base;
+    for (; level > 0 && geometries[g].lod_next >= 0; level--) {
+        g = geometries[g].lod_next;
+    }
+    if (g != instance.geometry) {
+        selected_triangles += clgeometries[g].num_indices / 3;
+        selected_triangles -= clgeometries[instance.geometry].num_indices / 3;
+        instance.geometry = g;
+        instance.revision++;
+    }
+}
+
+// Poses every skinned copy on the host, which only touches its joints, and
+// gives the copy's geometry the bounds of the pose so upload_changes
+// refits the BVH above its instance.
+void Scene::pose_skins(float time)
+{
+    for (auto & skin : skins) {
+        const Skeleton & skeleton = skeletons[skin.skeleton];
+        JointTransform* joints = joint_transforms.data() + skin.first_joint;
+        pose_skeleton(skeleton, skin.animation, time * skin.speed, joints);
+        clgeometries[skin.geometry].bounds = skinned_bounds(skeleton, joints);
+        dirty_geometries.mark(skin.geometry);
+        dirty_instances.mark(skin.instance);
+    }
+}
+
+// Reallocates a mirrored buffer its vector has outgrown, with room to
+// spare, and sends the whole vector. Returns the bytes written.
+template<typename T>
+static size_t grow_buffer(cl::Context& context, cl::CommandQueue& queue, cl::Buffer& buffer,
+                          size_t& capacity, const std::vector<T>& data)
+{
+    if (data.size() <= capacity) {
+        return 0;
+    }
+    capacity = std::max(data.size(), capacity * 2);
+    buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(T) * capacity);
+    queue.enqueueWriteBuffer(buffer, CL_FALSE, 0, sizeof(T) * data.size(), data.data());
+    return sizeof(T) * data.size();
+}
+
+// Refits the BVH above every moved instance, grows the buffers that runtime
+// edits outgrew, then writes the marked ranges of each mirror. Frames
+// without changes enqueue nothing.
+void Scene::upload_changes()
+{
+    for (auto & range : dirty_instances.coalesce()) {
+        for (size_t i = range.first; i < range.second && i < instances.size(); i++) {
+            world_bounds[i] = instance_bounds(instances[i],
+                                              clgeometries[instances[i].geometry].bounds);
+            select_lod(i);
+            refit_bvh(world_bounds, bvh, bvh_instances, bvh_parents,
+                      instance_leaves[i], dirty_bvh);
+        }
+    }
+    size_t grown = grow_buffer(context, queue, clview.instancesBuffer, instance_capacity, instances)
+                 + grow_buffer(context, queue, clview.geometriesBuffer, geometry_capacity,
+                               clgeometries)
+                 + grow_buffer(context, queue, clview.bvhBuffer, bvh_capacity, bvh)
+                 + grow_buffer(context, queue, clview.bvhInstancesBuffer, bvh_instance_capacity,
+                               bvh_instances);
+    if (grown > 0) {
+        layout_revision++;
+    }
+    uploaded_bytes = grown
+                   + dirty_instances.upload(queue, clview.instancesBuffer, instances)
+                   + dirty_bvh.upload(queue, clview.bvhBuffer, bvh)
+                   + dirty_bvh_instances.upload(queue, clview.bvhInstancesBuffer, bvh_instances)
+                   + dirty_geometries.upload(queue, clview.geometriesBuffer, clgeometries)
+                   + dirty_lights.upload(queue, clview.lightsBuffer, lights)
+                   + dirty_materials.upload(queue, clview.materialsBuffer, materials);
+}
+
+// Grows the OpenGL vertex and index buffers, and the triangles following
+// the indices, to cover everything the allocators handed out. The old
+// contents are copied on the GPU and the OpenCL views recreated.
+void Scene::reserve_geometry()
+{
+    const bool grow_vertices = vertex_ranges.size() > vertex_capacity;
+    const bool grow_indices = indice_ranges.size() > indice_capacity;
+    if (!grow_vertices && !grow_indices) {
+        return;
+    }
+    queue.finish();
+    clview.vertexBuffer = cl::BufferGL();
+    clview.vertexAttributesBuffer = cl::BufferGL();
+    clview.indicesBuffer = cl::BufferGL();
+
+    auto grow = [](GLuint& buffer, size_t old_size, size_t new_size) {
+        GLuint grown;
+        glGenBuffers(1, &grown);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+        glBufferData(GL_COPY_WRITE_BUFFER, new_size, nullptr, GL_STATIC_DRAW);
+        glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+        glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, old_size);
+        glDeleteBuffers(1, &buffer);
+        buffer = grown;
+    };
+    if (grow_vertices) {
+        size_t capacity = std::max(vertex_ranges.size(), vertex_capacity * 2);
+        size_t vertex_size = quantized_positions ? sizeof(QuantizedVertex) : sizeof(Vertex);
+        grow(glview.vertexBuffer, vertex_size * vertex_capacity, vertex_size * capacity);
+        grow(glview.vertexAttributesBuffer, sizeof(VertexAttributes) * vertex_capacity,
+             sizeof(VertexAttributes) * capacity);
+        vertex_capacity = capacity;
+    }
+    if (grow_indices) {
+        size_t capacity = std::max(indice_ranges.size(), indice_capacity * 2);
+        grow(glview.indicesBuffer, sizeof(Indice) * indice_capacity, sizeof(Indice) * capacity);
+        if (precomputed_triangles) {
+            cl::Buffer triangles(context, skins.empty() ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE,
+                                 sizeof(PrecomputedTriangle) * (capacity / 3));
+            queue.enqueueCopyBuffer(clview.trianglesBuffer, triangles, 0, 0,
+                                    sizeof(PrecomputedTriangle) * (indice_capacity / 3));
+            clview.trianglesBuffer = triangles;
+        }
+        indice_capacity = capacity;
+    }
+    glFinish();
+
+    const cl_mem_flags vertex_flags = skins.empty() ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE;
+    clview.vertexBuffer = cl::BufferGL(context, vertex_flags, glview.vertexBuffer);
+    clview.vertexAttributesBuffer = cl::BufferGL(context, vertex_flags,
+                                                 glview.vertexAttributesBuffer);
+    clview.indicesBuffer = cl::BufferGL(context, CL_MEM_READ_ONLY, glview.indicesBuffer);
+    layout_revision++;
+}
+
+void Scene::rebuild_bvh()
+{
+    build_bvh(world_bounds, bvh, bvh_instances);
+    link_bvh(bvh, bvh_instances, bvh_parents, instance_leaves);
+    bvh_dead_nodes = 0;
+    dirty_bvh.mark(0, bvh.size());
+    dirty_bvh_instances.mark(0, bvh_instances.size());
+    layout_revision++;
+}
+
+// Loads a mesh file into freshly allocated ranges and uploads it straight
+// to the device; the host arrays only ever describe the scene file. A file
+// that is already in the scene returns its geometry. Runtime meshes get no
+// generated levels of detail.
+cl_int Scene::add_mesh(const std::string & file)
+{
+    // Edits resize the host mirrors that last frame's uploads still read.
+    queue.finish();
+    for (size_t g = 0; g < geometries.size(); g++) {
+        if (geometries[g].file == file && geometries[g].lod_base == (cl_int)g) {
+            return g;
+        }
+    }
+
+    MeshInfo info = mesh_info(file);
+    std::vector<Vertex> mesh_vertices(info.num_vertices);
+    std::vector<VertexAttributes> mesh_attributes(info.num_vertices);
+    std::vector<Indice> mesh_indices(info.num_indices);
+    Geometry geometry;
+    geometry.file = file;
+    geometry.bounds = load_mesh(file, mesh_vertices.data(), mesh_attributes.data(),
+                                mesh_indices.data());
+    geometry.base_vertex = vertex_ranges.allocate(info.num_vertices);
+    geometry.base_indice = indice_ranges.allocate(info.num_indices);
+    geometry.num_vertices = info.num_vertices;
+    geometry.num_indices = info.num_indices;
+    geometry.lod_next = -1;
+    reserve_geometry();
+
+    queue.finish();
+    auto upload = [](GLuint buffer, size_t offset, size_t size, const void* data) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, buffer);
+        glBufferSubData(GL_COPY_WRITE_BUFFER, offset, size, data);
+    };
+    if (quantized_positions) {
+        std::vector<QuantizedVertex> quantized(info.num_vertices);
+        quantize_positions(mesh_vertices.data(), info.num_vertices, mesh_indices.data(),
+                           info.num_indices, geometry.bounds, quantized.data());
+        dequantize_positions(quantized.data(), info.num_vertices, geometry.bounds,
+                             mesh_vertices.data());
+        upload(glview.vertexBuffer, sizeof(QuantizedVertex) * geometry.base_vertex,
+               sizeof(QuantizedVertex) * info.num_vertices, quantized.data());
+    } else {
+        upload(glview.vertexBuffer, sizeof(Vertex) * geometry.base_vertex,
+               sizeof(Vertex) * info.num_vertices, mesh_vertices.data());
+    }
+    upload(glview.vertexAttributesBuffer, sizeof(VertexAttributes) * geometry.base_vertex,
+           sizeof(VertexAttributes) * info.num_vertices, mesh_attributes.data());
+    upload(glview.indicesBuffer, sizeof(Indice) * geometry.base_indice,
+           sizeof(Indice) * info.num_indices, mesh_indices.data());
+    glFinish();
+    if (precomputed_triangles) {
+        std::vector<PrecomputedTriangle> mesh_triangles(info.num_indices / 3);
+        precompute_triangles(mesh_vertices.data(), mesh_indices.data(), info.num_indices,
+                             mesh_triangles.data());
+        queue.enqueueWriteBuffer(clview.trianglesBuffer, CL_TRUE,
+                                 sizeof(PrecomputedTriangle) * (geometry.base_indice / 3),
+                                 sizeof(PrecomputedTriangle) * mesh_triangles.size(),
+                                 mesh_triangles.data());
+    }
+
+    cl_int g = geometries.size();
+    if (!free_geometries.empty()) {
+        g = free_geometries.back();
+        free_geometries.pop_back();
+    } else {
+        geometries.emplace_back();
+        clgeometries.emplace_back();
+    }
+    geometry.lod_base = g;
+    geometries[g] = geometry;
+    CLGeometry & clgeometry = clgeometries[g];
+    clgeometry.base_vertex = geometry.base_vertex;
+    clgeometry.base_indice = geometry.base_indice;
+    clgeometry.num_indices = geometry.num_indices;
+    clgeometry.shadow = g;
+    clgeometry.bounds = geometry.bounds;
+    dirty_geometries.mark(g);
+    return g;
+}
+
+// Frees the ranges of a mesh and all its levels of detail. The geometry
+// slots are reused by later meshes.
+void Scene::remove_mesh(cl_int geometry)
+{
+    queue.finish();
+    if (geometries[geometry].lod_base != geometry || geometries[geometry].num_indices == 0) {
+        throw std::runtime_error("Only whole meshes can be removed");
+    }
+    for (auto & instance : instances) {
+        if (geometries[instance.geometry].lod_base == geometry) {
+            throw std::runtime_error("Mesh " + geometries[geometry].file + " still has instances");
+        }
+    }
+    cl_int next;
+    for (cl_int g = geometry; g >= 0; g = next) {
+        Geometry & level = geometries[g];
+        next = level.lod_next;
+        vertex_ranges.free(level.base_vertex, level.num_vertices);
+        indice_ranges.free(level.base_indice, level.num_indices);
+        level.file.clear();
+        level.num_vertices = 0;
+        level.num_indices = 0;
+        level.lod_base = g;
+        level.lod_next = -1;
+        clgeometries[g].num_indices = 0;
+        clgeometries[g].shadow = g;
+        dirty_geometries.mark(g);
+        free_geometries.push_back(g);
+    }
+}
+
+// New instances are roots of the scene graph and go into the BVH next to
+// the instances they overlap most.
+cl_int Scene::add_instance(cl_int geometry, cl_int material, const Transform & placement)
+{
+    queue.finish();
+    cl_int i = instances.size();
+    Instance instance;
+    instance.geometry = geometry;
+    instance.material = material;
+    instance.revision = 0;
+    place(instance, graph.world(graph.add_node(-1, placement, i)));
+    instances.push_back(instance);
+    world_bounds.push_back(instance_bounds(instance, clgeometries[geometry].bounds));
+    selected_triangles += clgeometries[geometry].num_indices / 3;
+    select_lod(i);
+    if (!insert_bvh(world_bounds, bvh, bvh_instances, bvh_parents, instance_leaves, i,
+                    dirty_bvh, dirty_bvh_instances)) {
+        rebuild_bvh();
+    }
+    dirty_instances.mark(i);
+    layout_revision++;
+    return i;
+}
+
+// Swaps the last instance into the removed one's index. The BVH is
+// rebuilt once half its nodes are unreachable.
+void Scene::remove_instance(cl_int instance)
+{
+    queue.finish();
+    for (auto & skin : skins) {
+        if (skin.instance == instance) {
+            throw std::runtime_error("Skinned instances can not be removed");
+        }
+    }
+    cl_int last = instances.size() - 1;
+    selected_triangles -= clgeometries[instances[instance].geometry].num_indices / 3;
+    bvh_dead_nodes += remove_bvh(world_bounds, bvh, bvh_instances, bvh_parents,
+                                 instance_leaves, instance, dirty_bvh, dirty_bvh_instances);
+    graph.remove_instance(instance, last);
+    if (instance != last) {
+        const BVHNode & leaf = bvh[instance_leaves[last]];
+        for (cl_int slot = leaf.first; slot < leaf.first + leaf.count; slot++) {
+            if (bvh_instances[slot] == last) {
+                bvh_instances[slot] = instance;
+                dirty_bvh_instances.mark(slot);
+            }
+        }
+        instances[instance] = instances[last];
+        world_bounds[instance] = world_bounds[last];
+        instance_leaves[instance] = instance_leaves[last];
+        for (auto & skin : skins) {
+            if (skin.instance == last) {
+                skin.instance = instance;
+            }
+        }
+        dirty_instances.mark(instance);
+    }
+    instances.pop_back();
+    world_bounds.pop_back();
+    instance_leaves.pop_back();
+    if (bvh_dead_nodes * 2 > bvh.size()) {
+        rebuild_bvh();
+    }
+    layout_revision++;
+}
+
+static std::vector<InstanceKey> instance_keys(const YAML::Node & animation)
+{
+    std::vector<InstanceKey> keys;
+    for (auto n : animation["keys"]) {
+        InstanceKey key;
+        key.time = n["time"].as<float>();
+        auto position = n["position"] ? n["position"].as<cl_float3>() : cl_float3{{0.0f, 0.0f, 0.0f}};
+        key.position = glm::vec3(position.s[0], position.s[1], position.s[2]);
+        key.orientation = n["orientation"] ? n["orientation"].as<glm::quat>()
+                                           : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+        key.scale = n["scale"] ? n["scale"].as<float>() : 1.0f;
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static std::vector<LightKey> light_keys(const YAML::Node & animation)
+{
+    std::vector<LightKey> keys;
+    for (auto n : animation["keys"]) {
+        LightKey key;
+        key.time = n["time"].as<float>();
+        auto location = n["location"] ? n["location"].as<cl_float3>() : cl_float3{{0.0f, 0.0f, 0.0f}};
+        auto color = n["color"] ? n["color"].as<cl_float3>() : cl_float3{{1.0f, 1.0f, 1.0f}};
+        key.location = glm::vec3(location.s[0], location.s[1], location.s[2]);
+        key.color = glm::vec3(color.s[0], color.s[1], color.s[2]);
+        key.radius = n["radius"] ? n["radius"].as<float>() : 1.0f;
+        keys.push_back(key);
+    }
+    return keys;
+}
+
+static bool looping(const YAML::Node & animation)
+{
+    return !animation["loop"] || animation["loop"].as<bool>();
+}
+
+// Scale is a scalar or a vector with equal components, instances only
+// carry a uniform scale.
+static cl_float uniform_scale(const YAML::Node & node)
+{
+    if (node.IsScalar()) {
+        return node.as<cl_float>();
+    }
+    auto scale = node.as<cl_float3>();
+    if (scale.s[0] != scale.s[1] || scale.s[0] != scale.s[2]) {
+        throw std::runtime_error("Non-uniform instance scale is not supported");
+    }
+    return scale.s[0];
+}
+
+static Transform placement(const YAML::Node & node)
+{
+    Transform local;
+    auto position = node["position"] ? node["position"].as<cl_float3>()
+                                     : cl_float3{{0.0f, 0.0f, 0.0f}};
+    local.position = glm::vec3(position.s[0], position.s[1], position.s[2]);
+    local.orientation = node["orientation"] ? node["orientation"].as<glm::quat>()
+                                            : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+    local.scale = node["scale"] ? uniform_scale(node["scale"]) : 1.0f;
+    return local;
 }
 
 Scene Scene::load(const std::string & filename, cl::Context context, cl::Device device, cl::CommandQueue queue)
+{
+    if (is_package(filename)) {
+        return load_package(filename, context, device, queue);
+    }
+
+    Scene scene = read(filename, true);
+    scene.context = context;
+    scene.device = device;
+    scene.queue = queue;
+    if (scene.virtual_textures) {
+        scene.virtual_diffuse.reset(new VirtualTexture(context, queue, scene.materials,
+                                                       filename + ".tiles",
+                                                       scene.cache_tiles));
+    }
+
+    scene.init_glview(scene.quantized_positions
+                      ? (const void*)scene.quantized_vertices.data()
+                      : (const void*)scene.vertices.data(),
+                      scene.quantized_positions
+                      ? sizeof(QuantizedVertex) * scene.quantized_vertices.size()
+                      : sizeof(Vertex) * scene.vertices.size(),
+                      scene.vertexAttributes.data(),
+                      sizeof(VertexAttributes) * scene.vertexAttributes.size(),
+                      scene.indices.data(), sizeof(Indice) * scene.indices.size());
+    scene.init_clview(scene.compressed_textures
+                      ? (const void*)scene.diffuse_blocks.data()
+                      : (const void*)scene.diffuse_atlas.pixels.data(),
+                      scene.compressed_textures
+                      ? sizeof(BC1Block) * scene.diffuse_blocks.size()
+                      : scene.diffuse_atlas.pixels.size(),
+                      scene.triangles.data(),
+                      sizeof(PrecomputedTriangle) * scene.triangles.size());
+    if (!scene.skins.empty()) {
+        scene.skinner.reset(new Skinner(context, device, queue, scene.skin_vertices,
+                                        scene.skin_triangles, scene.joint_transforms.size()));
+    }
+
+    return scene;
+}
+
+// Parses the YAML description and builds every host side array, without
+// touching the GPU. Used by load() and by the scene packer.
+Scene Scene::read(const std::string & filename, bool tiles_only)
 {
     YAML::Node scene_file = YAML::LoadFile(filename);
 
-    Scene scene(context, device, queue);
+    Scene scene{cl::Context(), cl::Device(), cl::CommandQueue()};
     scene.lights = scene_file["lights"].as<std::vector<Light>>();
+    for (size_t l = 0; l < scene.lights.size(); l++) {
+        auto animation = scene_file["lights"][l]["animation"];
+        if (animation) {
+            scene.animator.add_track(l, scene.lights[l], light_keys(animation),
+                                     looping(animation), 0.0f);
+        }
+    }
 
+    // Textures and meshes are decoded on the pool. Every job writes into a
+    // slot sized up front, so none of the shared vectors reallocate while
+    // jobs are running. The vectors are declared before the pool, whose
+    // destructor drains the queue, so a throw in between never leaves a
+    // job writing into freed memory.
+    auto start = std::chrono::steady_clock::now();
+    std::vector<Texture> diffuse_textures;
+    std::vector<std::vector<std::vector<Indice>>> lod_indices;
+    std::vector<std::vector<float>> lod_errors;
+    std::vector<QuantizationReport> reports;
+    ThreadPool pool;
+    std::vector<std::future<void>> jobs;
+    auto finish_jobs = [&jobs] {
+        for (auto & job : jobs) {
+            job.wait();
+        }
+        for (auto & job : jobs) {
+            job.get();
+        }
+        jobs.clear();
+    };
+
+    std::vector<std::string> texture_files;
     for(auto n : scene_file["materials"]) {
         Material mat;
-        auto diffuse = load_texture("../textures/" + n["diffuse"].as<std::string>());
-        scene.diffuse_array.insert(scene.diffuse_array.end(),
-                                   diffuse.begin(),
-                                   diffuse.end());
-        mat.diffuse = scene.materials.size();
+        texture_files.push_back("../textures/" + n["diffuse"].as<std::string>());
         mat.fresnel0 = n["fresnel0"].as<float>();
         mat.roughness = n["roughness"].as<float>();
         scene.materials.push_back(mat);
     }
 
-    for(auto n : scene_file["meshes"]) {
-        Mesh mesh = load_mesh(n["file"].as<std::string>());
-        CLMesh clmesh;
-        clmesh.num_indices = mesh.indices.size();
-        clmesh.material = n["material"].as<cl_int>();
-        clmesh.position = n["position"].as<cl_float3>();
-        clmesh.scale = n["scale"].as<cl_float3>();
-        clmesh.orientation = n["orientation"].as<glm::quat>();
-        clmesh.base_vertex = scene.vertices.size();
-        clmesh.base_indice = scene.indices.size();
-
-        BVHNode bvhnode;
-        bvhnode.bounds = mesh.bounds;
-        bvhnode.mesh = scene.clmeshes.size();
-        bvhnode.scale = clmesh.scale;
-        bvhnode.position = clmesh.position;
-
-        scene.vertices.insert(scene.vertices.end(), 
-                              mesh.vertices.begin(), 
-                              mesh.vertices.end());
-        scene.vertexAttributes.insert(scene.vertexAttributes.end(),
-                                      mesh.vertexAttributes.begin(),
-                                      mesh.vertexAttributes.end());
-        scene.indices.insert(scene.indices.end(), 
-                               mesh.indices.begin(), 
-                               mesh.indices.end());
-        scene.clmeshes.push_back(clmesh);
-        scene.bvh.push_back(bvhnode);
-    }
-
-    scene.init_glview();
-    scene.init_clview();
+    auto page_size = scene_file["atlas_page_size"]
+                   ? scene_file["atlas_page_size"].as<unsigned int>() : 2048;
+    scene.virtual_textures = scene_file["virtual_textures"]
+                          && scene_file["virtual_textures"].as<bool>();
+    const unsigned int page_align = scene.virtual_textures ? VirtualTexture::tile_size : 4;
+    page_size = (page_size + page_align - 1) / page_align * page_align;
+
+    // A tile file cut from the same texture files already holds the atlas
+    // and its layout, so none of the textures have to be decoded.
+    const std::string tile_filename = filename + ".tiles";
+    const bool write_tiles = tiles_only && scene.virtual_textures;
+    uint64_t tile_key = 0;
+    bool tiles_current = false;
+    if (write_tiles) {
+        tile_key = VirtualTexture::source_key(texture_files, page_size);
+        tiles_current = VirtualTexture::read_layout(tile_filename, tile_key,
+                                                    scene.diffuse_atlas, scene.materials);
+    }
+    diffuse_textures.resize(tiles_current ? 0 : texture_files.size());
+    for (size_t i = 0; i < diffuse_textures.size(); i++) {
+        Texture* texture = &diffuse_textures[i];
+        std::string texture_filename = texture_files[i];
+        jobs.push_back(pool.submit([texture, texture_filename] {
+            *texture = load_texture(texture_filename);
+        }));
+    }
+
+    scene.quantized_positions = scene_file["quantize_positions"]
+                             && scene_file["quantize_positions"].as<bool>();
+    scene.precomputed_triangles = scene_file["precomputed_triangles"]
+                               && scene_file["precomputed_triangles"].as<bool>();
+    // Meshes are deduplicated by file, every instance of a file points at
+    // the same vertex and index range and so shares its triangles too.
+    // Skinned copies are the exception, each deforms its own range.
+    std::map<std::string, cl_int> geometry_index;
+    size_t num_vertices = 0;
+    size_t num_indices = 0;
+    auto add_geometry = [&](const std::string & file) {
+        MeshInfo info = mesh_info(file);
+        Geometry geometry;
+        geometry.file = file;
+        geometry.base_vertex = num_vertices;
+        geometry.base_indice = num_indices;
+        geometry.num_vertices = info.num_vertices;
+        geometry.num_indices = info.num_indices;
+        geometry.lod_base = scene.geometries.size();
+        geometry.lod_next = -1;
+        num_vertices += info.num_vertices;
+        num_indices += info.num_indices;
+        scene.geometries.push_back(geometry);
+        return (cl_int)scene.geometries.size() - 1;
+    };
+    // Coarser levels of a mesh come from the files listed under lods, or
+    // are generated from it after loading when lod gives a level count.
+    // The first entry of a file that asks for levels decides them.
+    std::vector<std::pair<cl_int, YAML::Node>> generated_lods;
+    std::set<cl_int> lod_chains;
+    auto geometry_of = [&](const YAML::Node & n) {
+        auto file = n["file"].as<std::string>();
+        auto found = geometry_index.find(file);
+        if (found == geometry_index.end()) {
+            found = geometry_index.emplace(file, add_geometry(file)).first;
+        }
+        cl_int base = found->second;
+        if ((n["lods"] || n["lod"]) && lod_chains.insert(base).second) {
+            cl_int previous = base;
+            for (auto lod : n["lods"]) {
+                cl_int level = add_geometry(lod.as<std::string>());
+                scene.geometries[level].lod_base = base;
+                scene.geometries[previous].lod_next = level;
+                previous = level;
+            }
+            if (n["lod"]) {
+                generated_lods.emplace_back(base, n["lod"]);
+            }
+        }
+        return base;
+    };
+    // A group under nodes places its meshes, arrays and groups relative to
+    // itself and may be animated as a whole; the file is the root group.
+    // Everything goes in depth first, so the graph and the instances come
+    // out in the same order.
+    std::vector<std::string> skin_animations;
+    std::function<void(const YAML::Node &, cl_int)> read_group =
+        [&](const YAML::Node & group, cl_int parent) {
+        for (auto n : group["meshes"]) {
+            Instance instance;
+            instance.geometry = n["skin"] ? add_geometry(n["file"].as<std::string>())
+                                          : geometry_of(n);
+            instance.material = n["material"].as<cl_int>();
+            instance.revision = 0;
+            Transform local = placement(n);
+            cl_int node = scene.graph.add_node(parent, local, scene.instances.size());
+            place(instance, scene.graph.world(node));
+            if (n["animation"]) {
+                scene.animator.add_track(node, local, instance_keys(n["animation"]),
+                                         looping(n["animation"]), 0.0f);
+            }
+            if (n["skin"]) {
+                Skin skin;
+                skin.instance = scene.instances.size();
+                skin.geometry = instance.geometry;
+                skin.speed = n["skin"]["speed"] ? n["skin"]["speed"].as<float>() : 1.0f;
+                skin_animations.push_back(n["skin"]["animation"]
+                                          ? n["skin"]["animation"].as<std::string>() : "");
+                scene.skins.push_back(skin);
+            }
+            scene.instances.push_back(instance);
+        }
+
+        // Procedural grids of one mesh, origin + index * spacing per axis,
+        // optionally turned by a random angle around y. An animation is
+        // shared by the whole grid, random_phase starts every copy at a
+        // different key.
+        for (auto n : group["instance_arrays"]) {
+            Instance instance;
+            instance.geometry = geometry_of(n);
+            instance.material = n["material"].as<cl_int>();
+            instance.revision = 0;
+            Transform local;
+            local.scale = n["scale"] ? uniform_scale(n["scale"]) : 1.0f;
+            auto orientation = n["orientation"] ? n["orientation"].as<glm::quat>()
+                                                : glm::quat(1.0f, 0.0f, 0.0f, 0.0f);
+            auto count = n["count"].as<std::vector<int>>();
+            auto origin = n["origin"].as<cl_float3>();
+            auto spacing = n["spacing"].as<cl_float3>();
+            bool random_yaw = n["random_yaw"] && n["random_yaw"].as<bool>();
+            std::mt19937 rng(n["seed"] ? n["seed"].as<unsigned int>() : 0);
+            std::uniform_real_distribution<float> angle(0.0f, 2.0f * (float)M_PI);
+            auto keys = n["animation"] ? instance_keys(n["animation"])
+                                       : std::vector<InstanceKey>();
+            bool loop = n["animation"] && looping(n["animation"]);
+            bool random_phase = n["animation"] && n["animation"]["random_phase"]
+                             && n["animation"]["random_phase"].as<bool>();
+            std::uniform_real_distribution<float> phase(0.0f, keys.empty() ? 0.0f
+                                                        : keys.back().time - keys.front().time);
+            if (count.size() != 3) {
+                throw std::runtime_error("Instance array count needs three axes");
+            }
+            scene.instances.reserve(scene.instances.size()
+                                    + (size_t)count[0] * count[1] * count[2]);
+            for (int z = 0; z < count[2]; z++) {
+                for (int y = 0; y < count[1]; y++) {
+                    for (int x = 0; x < count[0]; x++) {
+                        local.position = glm::vec3(origin.s[0] + x * spacing.s[0],
+                                                   origin.s[1] + y * spacing.s[1],
+                                                   origin.s[2] + z * spacing.s[2]);
+                        local.orientation = random_yaw
+                            ? glm::angleAxis(angle(rng), glm::vec3(0.0f, 1.0f, 0.0f)) * orientation
+                            : orientation;
+                        cl_int node = scene.graph.add_node(parent, local,
+                                                           scene.instances.size());
+                        place(instance, scene.graph.world(node));
+                        scene.animator.add_track(node, local, keys, loop,
+                                                 random_phase ? phase(rng) : 0.0f);
+                        scene.instances.push_back(instance);
+                    }
+                }
+            }
+        }
+
+        for (auto n : group["nodes"]) {
+            Transform local = placement(n);
+            cl_int node = scene.graph.add_node(parent, local);
+            if (n["animation"]) {
+                scene.animator.add_track(node, local, instance_keys(n["animation"]),
+                                         looping(n["animation"]), 0.0f);
+            }
+            read_group(n, node);
+            scene.graph.end_group(node);
+        }
+    };
+    read_group(scene_file, -1);
+
+    scene.vertices.resize(num_vertices);
+    scene.vertexAttributes.resize(num_vertices);
+    scene.indices.resize(num_indices);
+    for (size_t g = 0; g < scene.geometries.size(); g++) {
+        jobs.push_back(pool.submit([&scene, g] {
+            Geometry & geometry = scene.geometries[g];
+            geometry.bounds = load_mesh(geometry.file,
+                                        scene.vertices.data() + geometry.base_vertex,
+                                        scene.vertexAttributes.data() + geometry.base_vertex,
+                                        scene.indices.data() + geometry.base_indice);
+        }));
+    }
+    finish_jobs();
+
+    // Generated levels keep indexing the vertices of the full mesh, each
+    // one a quarter of the triangles of the one before by default. A chain
+    // ends early once the simplifier stops making progress, and never goes
+    // below a tetrahedron's worth of triangles.
+    const size_t min_indices = 12;
+    lod_indices.resize(generated_lods.size());
+    lod_errors.resize(generated_lods.size());
+    for (size_t c = 0; c < generated_lods.size(); c++) {
+        const Geometry & base = scene.geometries[generated_lods[c].first];
+        const YAML::Node & lod = generated_lods[c].second;
+        int levels = lod["levels"].as<int>();
+        float ratio = lod["ratio"] ? lod["ratio"].as<float>() : 0.25f;
+        jobs.push_back(pool.submit([&scene, &lod_indices, &lod_errors, &base, c, levels, ratio,
+                                    min_indices] {
+            const Indice* previous = scene.indices.data() + base.base_indice;
+            size_t previous_size = base.num_indices;
+            for (int level = 1; level < levels; level++) {
+                std::vector<Indice> simplified;
+                float error = simplify(scene.vertices.data() + base.base_vertex,
+                                       base.num_vertices, previous, previous_size,
+                                       std::max((size_t)(previous_size * ratio), min_indices),
+                                       simplified);
+                if (simplified.size() > previous_size * 0.9f) {
+                    break;
+                }
+                lod_indices[c].push_back(std::move(simplified));
+                lod_errors[c].push_back(error);
+                previous = lod_indices[c].back().data();
+                previous_size = lod_indices[c].back().size();
+            }
+        }));
+    }
+    finish_jobs();
+    for (size_t c = 0; c < generated_lods.size(); c++) {
+        cl_int previous = generated_lods[c].first;
+        std::ostringstream summary;
+        summary << scene.geometries[previous].file << " LOD: "
+                << scene.geometries[previous].num_indices / 3;
+        for (size_t l = 0; l < lod_indices[c].size(); l++) {
+            Geometry level = scene.geometries[generated_lods[c].first];
+            level.base_indice = scene.indices.size();
+            level.num_vertices = 0;
+            level.num_indices = lod_indices[c][l].size();
+            level.lod_next = -1;
+            scene.indices.insert(scene.indices.end(), lod_indices[c][l].begin(),
+                                 lod_indices[c][l].end());
+            scene.geometries[previous].lod_next = scene.geometries.size();
+            previous = scene.geometries.size();
+            scene.geometries.push_back(level);
+            summary << " / " << level.num_indices / 3 << " (error "
+                    << lod_errors[c][l] << ")";
+        }
+        if (verbose) {
+            std::cout << summary.str() << " triangles" << std::endl;
+        }
+    }
+
+    // Every level of a chain gets the bounds of the whole chain, so
+    // switching levels never moves the instance in the BVH.
+    for (auto & geometry : scene.geometries) {
+        if (geometry.lod_base != &geometry - scene.geometries.data()
+         || geometry.lod_next < 0) {
+            continue;
+        }
+        AABB bounds = geometry.bounds;
+        for (cl_int g = geometry.lod_next; g >= 0; g = scene.geometries[g].lod_next) {
+            for (int j = 0; j < 3; j++) {
+                bounds.min.s[j] = std::min(bounds.min.s[j], scene.geometries[g].bounds.min.s[j]);
+                bounds.max.s[j] = std::max(bounds.max.s[j], scene.geometries[g].bounds.max.s[j]);
+            }
+        }
+        for (cl_int g = geometry.lod_base; g >= 0; g = scene.geometries[g].lod_next) {
+            scene.geometries[g].bounds = bounds;
+        }
+    }
+
+    // Generated levels own no vertices, their base quantizes them.
+    if (scene.quantized_positions) {
+        scene.quantized_vertices.resize(num_vertices);
+    }
+    if (scene.precomputed_triangles) {
+        scene.triangles.resize(scene.indices.size() / 3);
+    }
+    // Quantizing rewrites the host positions, and levels of detail read
+    // their base's vertices, so all of it finishes before any triangle
+    // is precomputed.
+    reports.resize(scene.geometries.size());
+    for (size_t g = 0; g < scene.geometries.size() && scene.quantized_positions; g++) {
+        jobs.push_back(pool.submit([&scene, &reports, g] {
+            Geometry & geometry = scene.geometries[g];
+            if (geometry.num_vertices == 0) {
+                return;
+            }
+            Vertex* vertices = scene.vertices.data() + geometry.base_vertex;
+            QuantizedVertex* quantized = scene.quantized_vertices.data() + geometry.base_vertex;
+            reports[g] = quantize_positions(vertices, geometry.num_vertices,
+                                            scene.indices.data() + geometry.base_indice,
+                                            geometry.num_indices, geometry.bounds, quantized);
+            dequantize_positions(quantized, geometry.num_vertices, geometry.bounds, vertices);
+        }));
+    }
+    finish_jobs();
+    for (size_t g = 0; g < scene.geometries.size() && scene.precomputed_triangles; g++) {
+        jobs.push_back(pool.submit([&scene, g] {
+            Geometry & geometry = scene.geometries[g];
+            precompute_triangles(scene.vertices.data() + geometry.base_vertex,
+                                 scene.indices.data() + geometry.base_indice,
+                                 geometry.num_indices,
+                                 scene.triangles.data() + geometry.base_indice / 3);
+        }));
+    }
+    finish_jobs();
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+    // Skinned copies of one file share its skeleton, but each has its own
+    // joints and bind pose vertices pointing at its own geometry range.
+    if (!scene.skins.empty() && scene.quantized_positions) {
+        throw std::runtime_error("Skinned meshes need unquantized positions");
+    }
+    std::map<std::string, cl_int> skeleton_index;
+    std::vector<std::vector<SkinVertex>> bind_poses;
+    for (size_t s = 0; s < scene.skins.size(); s++) {
+        Skin & skin = scene.skins[s];
+        const Geometry & geometry = scene.geometries[skin.geometry];
+        auto found = skeleton_index.find(geometry.file);
+        if (found == skeleton_index.end()) {
+            found = skeleton_index.emplace(geometry.file, scene.skeletons.size()).first;
+            scene.skeletons.emplace_back();
+            bind_poses.emplace_back(geometry.num_vertices);
+            load_skeleton(geometry.file, scene.skeletons.back(), bind_poses.back().data());
+        }
+        skin.skeleton = found->second;
+        const Skeleton & skeleton = scene.skeletons[skin.skeleton];
+        skin.animation = skin_animations[s].empty() ? 0 : skeleton.animation(skin_animations[s]);
+        skin.first_joint = scene.joint_transforms.size();
+        scene.joint_transforms.resize(skin.first_joint + skeleton.parents.size());
+        if (scene.joint_transforms.size() > 0xffff) {
+            throw std::runtime_error("Too many skinned joints");
+        }
+        for (cl_int v = 0; v < geometry.num_vertices; v++) {
+            SkinVertex vertex = bind_poses[skin.skeleton][v];
+            for (int k = 0; k < 4; k++) {
+                vertex.joints.s[k] += skin.first_joint;
+            }
+            vertex.target = geometry.base_vertex + v;
+            scene.skin_vertices.push_back(vertex);
+        }
+        if (scene.precomputed_triangles) {
+            for (cl_int t = 0; t < geometry.num_indices / 3; t++) {
+                scene.skin_triangles.push_back({{ geometry.base_indice / 3 + t,
+                                                  geometry.base_vertex }});
+            }
+        }
+    }
+
+    if (verbose) {
+        std::cout << "Loaded " << diffuse_textures.size() << " textures and "
+                  << scene.geometries.size() << " meshes (" << scene.instances.size()
+                  << " instances) in " << elapsed.count() << " ms" << std::endl;
+    }
+
+    auto budget = scene_file["texture_budget"]
+                ? scene_file["texture_budget"].as<size_t>() : 256;
+    // Virtual textures only keep the tiles in use on the device, the budget
+    // does not apply to them.
+    if (!tiles_current) {
+        scene.diffuse_atlas = pack_atlas(diffuse_textures, page_size, 4,
+                                         scene.virtual_textures
+                                         ? std::numeric_limits<size_t>::max() : budget << 20);
+    }
+    scene.compressed_textures = !scene.virtual_textures
+                             && scene_file["texture_compression"]
+                             && scene_file["texture_compression"].as<std::string>() == "bc1";
+    if (scene.compressed_textures) {
+        scene.diffuse_blocks = encode_bc1(scene.diffuse_atlas);
+    }
+    if (verbose) {
+        std::cout << "Diffuse atlas: " << scene.diffuse_atlas.pages << " pages, "
+                  << (scene.compressed_textures
+                      ? sizeof(BC1Block) * scene.diffuse_blocks.size()
+                      : scene.diffuse_atlas.pixels.size()) / 1024
+                  << " KiB" << (scene.compressed_textures ? " (BC1)" : "")
+                  << std::endl;
+    }
+    for (size_t i = 0; i < diffuse_textures.size(); i++) {
+        auto & mat = scene.materials[i];
+        auto & region = scene.diffuse_atlas.regions[i];
+        mat.diffuse = region.page;
+        mat.uv_offset = {{ (cl_float)region.x, (cl_float)region.y }};
+        mat.uv_scale = {{ (cl_float)diffuse_textures[i].width,
+                          (cl_float)diffuse_textures[i].height }};
+    }
+    if (write_tiles && !tiles_current) {
+        VirtualTexture::write_tiles(tile_filename, tile_key, scene.diffuse_atlas, scene.materials);
+    }
+    if (write_tiles) {
+        std::vector<unsigned char>().swap(scene.diffuse_atlas.pixels);
+        if (verbose) {
+            std::cout << (tiles_current ? "Reused " : "Wrote ") << tile_filename << std::endl;
+        }
+    }
+    scene.cache_tiles = scene_file["texture_cache_tiles"]
+                      ? scene_file["texture_cache_tiles"].as<unsigned int>() : 256;
+
+    for (size_t g = 0; g < scene.geometries.size() && scene.quantized_positions && verbose; g++) {
+        if (scene.geometries[g].num_vertices == 0) {
+            continue;
+        }
+        auto & report = reports[g];
+        std::cout << scene.geometries[g].file << ": max position error "
+                  << report.max_error << " (" << report.relative_error * 100.0f
+                  << "% of the diagonal), " << report.collapsed_triangles
+                  << " collapsed triangles" << std::endl;
+    }
+
+    for (auto & geometry : scene.geometries) {
+        CLGeometry clgeometry;
+        clgeometry.base_vertex = geometry.base_vertex;
+        clgeometry.base_indice = geometry.base_indice;
+        clgeometry.num_indices = geometry.num_indices;
+        clgeometry.shadow = geometry.lod_next >= 0 ? geometry.lod_next
+                                                   : scene.clgeometries.size();
+        clgeometry.bounds = geometry.bounds;
+        scene.clgeometries.push_back(clgeometry);
+    }
+
+    scene.pose_skins(0.0f);
+    scene.world_bounds.reserve(scene.instances.size());
+    for (auto & instance : scene.instances) {
+        scene.world_bounds.push_back(instance_bounds(instance,
+                                                     scene.clgeometries[instance.geometry].bounds));
+    }
+    scene.lod_size = scene_file["lod_size"] ? scene_file["lod_size"].as<float>() : 0.05f;
+    scene.selected_triangles = 0;
+    for (size_t i = 0; i < scene.instances.size(); i++) {
+        scene.select_lod(i);
+    }
+    for (auto & instance : scene.instances) {
+        scene.selected_triangles += scene.clgeometries[instance.geometry].num_indices / 3;
+    }
+    auto bvh_start = std::chrono::steady_clock::now();
+    build_bvh(scene.world_bounds, scene.bvh, scene.bvh_instances);
+    link_bvh(scene.bvh, scene.bvh_instances, scene.bvh_parents, scene.instance_leaves);
+    std::chrono::duration<double, std::milli> bvh_elapsed =
+        std::chrono::steady_clock::now() - bvh_start;
+    if (scene.animator.size() > 0 && verbose) {
+        std::cout << "Animation: " << scene.animator.size() << " tracks" << std::endl;
+    }
+    if (scene.graph.size() > scene.instances.size() && verbose) {
+        std::cout << "Scene graph: " << scene.graph.size() - scene.instances.size()
+                  << " groups" << std::endl;
+    }
+    if (!scene.skins.empty() && verbose) {
+        std::cout << "Skinning: " << scene.skins.size() << " copies, "
+                  << scene.skin_vertices.size() << " vertices, "
+                  << scene.joint_transforms.size() << " joints" << std::endl;
+    }
+    if (verbose) {
+        std::cout << "Instance BVH: " << scene.bvh.size() << " nodes over "
+                  << scene.instances.size() << " instances in " << bvh_elapsed.count()
+                  << " ms" << std::endl;
+    }
+
+    if (scene.precomputed_triangles && verbose) {
+        std::cout << "Precomputed triangles: "
+                  << sizeof(PrecomputedTriangle) * scene.triangles.size() / 1024
+                  << " KiB" << std::endl;
+    }
+
+    return scene;
+}
+
+// A package is memory mapped and every large section goes to the driver
+// straight from the mapping; only the small arrays that update() rewrites
+// are copied into the host vectors.
+Scene Scene::load_package(const std::string & filename, cl::Context context,
+                          cl::Device device, cl::CommandQueue queue)
+{
+    using namespace boost::iostreams;
+
+    auto start = std::chrono::steady_clock::now();
+    mapped_file_source package(filename);
+    const PackageHeader & header = read_package_header(package.data(), package.size());
+
+    Scene scene(context, device, queue);
+    scene.compressed_textures = header.flags & package_compressed_textures;
+    scene.quantized_positions = header.flags & package_quantized_positions;
+    scene.precomputed_triangles = header.flags & package_precomputed_triangles;
+    scene.diffuse_atlas.page_size = header.atlas_page_size;
+    scene.diffuse_atlas.pages = header.atlas_pages;
+
+    auto section = [&](PackageSectionId id) {
+        return package.data() + header.sections[id].offset;
+    };
+    auto size = [&](PackageSectionId id) {
+        return (size_t)header.sections[id].size;
+    };
+    auto copy = [&](PackageSectionId id, auto & vector) {
+        using T = typename std::decay<decltype(vector)>::type::value_type;
+        auto first = reinterpret_cast<const T*>(section(id));
+        vector.assign(first, first + size(id) / sizeof(T));
+    };
+    copy(package_instances, scene.instances);
+    copy(package_geometries, scene.clgeometries);
+    copy(package_bvh, scene.bvh);
+    copy(package_bvh_instances, scene.bvh_instances);
+    // Packages keep no files or level chains, so every geometry stands
+    // alone for runtime edits. A run of vertices belongs to the first
+    // geometry starting at it; levels sharing it own none.
+    std::map<cl_int, cl_int> vertex_owners;
+    scene.geometries.resize(scene.clgeometries.size());
+    for (size_t g = 0; g < scene.clgeometries.size(); g++) {
+        const CLGeometry & clgeometry = scene.clgeometries[g];
+        Geometry & geometry = scene.geometries[g];
+        geometry.base_vertex = clgeometry.base_vertex;
+        geometry.base_indice = clgeometry.base_indice;
+        geometry.num_vertices = 0;
+        geometry.num_indices = clgeometry.num_indices;
+        geometry.lod_base = g;
+        geometry.lod_next = -1;
+        geometry.bounds = clgeometry.bounds;
+        vertex_owners.emplace(clgeometry.base_vertex, g);
+    }
+    const cl_int num_vertices = size(package_vertex_attributes) / sizeof(VertexAttributes);
+    for (auto owner = vertex_owners.begin(); owner != vertex_owners.end(); ++owner) {
+        auto next = std::next(owner);
+        scene.geometries[owner->second].num_vertices
+            = (next == vertex_owners.end() ? num_vertices : next->first) - owner->first;
+    }
+    for (auto & instance : scene.instances) {
+        scene.world_bounds.push_back(instance_bounds(instance,
+                                                     scene.clgeometries[instance.geometry].bounds));
+    }
+    link_bvh(scene.bvh, scene.bvh_instances, scene.bvh_parents, scene.instance_leaves);
+    for (auto & instance : scene.instances) {
+        scene.selected_triangles += scene.clgeometries[instance.geometry].num_indices / 3;
+    }
+    copy(package_lights, scene.lights);
+    copy(package_materials, scene.materials);
+
+    scene.init_glview(section(package_vertices), size(package_vertices),
+                      section(package_vertex_attributes), size(package_vertex_attributes),
+                      section(package_indices), size(package_indices));
+    scene.init_clview(section(package_textures), size(package_textures),
+                      section(package_triangles), size(package_triangles));
 
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    if (verbose) {
+        std::cout << "Loaded package " << filename << " (" << package.size() / 1024
+                  << " KiB) in " << elapsed.count() << " ms" << std::endl;
+    }
     return scene;
 }
 
-void Scene::init_glview()
+void Scene::init_glview(const void* vertex_data, size_t vertex_size,
+                        const void* attribute_data, size_t attribute_size,
+                        const void* indice_data, size_t indice_size)
 {
     glGenBuffers(1, &glview.vertexBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, glview.vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), 
-                 vertices.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, vertex_size, vertex_data, GL_STATIC_DRAW);
 
     glGenBuffers(1, &glview.vertexAttributesBuffer);
     glBindBuffer(GL_ARRAY_BUFFER, glview.vertexAttributesBuffer);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(VertexAttributes) * vertexAttributes.size(),
-                 vertexAttributes.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ARRAY_BUFFER, attribute_size, attribute_data, GL_STATIC_DRAW);
     
     glGenBuffers(1, &glview.indicesBuffer);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, glview.indicesBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(Indice) * indices.size(),
-                 indices.data(), GL_STATIC_DRAW);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indice_size, indice_data, GL_STATIC_DRAW);
+
+    vertex_capacity = attribute_size / sizeof(VertexAttributes);
+    indice_capacity = indice_size / sizeof(Indice);
+    vertex_ranges = RangeAllocator(vertex_capacity);
+    indice_ranges = RangeAllocator(indice_capacity);
 }
 
-void Scene::init_clview()
+void Scene::init_clview(const void* texture_data, size_t texture_size,
+                        const void* triangle_data, size_t triangle_size)
 {
     clview.lightsBuffer = cl::Buffer(context, lights.begin(), 
                                     lights.end(), true);
     clview.materialsBuffer = cl::Buffer(context, materials.begin(), 
                                        materials.end(), true);
-    auto format = cl::ImageFormat(CL_RGBA, CL_UNSIGNED_INT8);
-    clview.diffuseBuffer = cl::Image2DArray(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                            format, materials.size(),
-                                            512, 512, 0, 0, diffuse_array.data());
+    // Only one of the image and the block buffer is bound for real, the
+    // other gets a placeholder to keep the kernel signature fixed.
+    auto format = cl::ImageFormat(CL_RGBA, CL_UNORM_INT8);
+    if (virtual_diffuse) {
+        clview.diffuseBuffer = virtual_diffuse->cache;
+        clview.diffuseBlocksBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(BC1Block));
+    } else if (compressed_textures) {
+        unsigned char placeholder[4] = {};
+        clview.diffuseBuffer = cl::Image2DArray(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                format, 1, 1, 1, 0, 0, placeholder);
+        clview.diffuseBlocksBuffer = cl::Buffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                texture_size, const_cast<void*>(texture_data));
+    } else {
+        clview.diffuseBuffer = cl::Image2DArray(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                                                format, diffuse_atlas.pages,
+                                                diffuse_atlas.page_size,
+                                                diffuse_atlas.page_size,
+                                                0, 0, const_cast<void*>(texture_data));
+        clview.diffuseBlocksBuffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(BC1Block));
+    }
 
-    clview.vertexBuffer = cl::BufferGL(context, CL_MEM_READ_ONLY, glview.vertexBuffer);
-    clview.vertexAttributesBuffer = cl::BufferGL(context, CL_MEM_READ_ONLY, 
+    // Skinning writes the deformed copies back into the vertex buffers.
+    const cl_mem_flags vertex_flags = skins.empty() ? CL_MEM_READ_ONLY : CL_MEM_READ_WRITE;
+    clview.vertexBuffer = cl::BufferGL(context, vertex_flags, glview.vertexBuffer);
+    clview.vertexAttributesBuffer = cl::BufferGL(context, vertex_flags,
                                                  glview.vertexAttributesBuffer);
     clview.indicesBuffer = cl::BufferGL(context, CL_MEM_READ_ONLY,
                                         glview.indicesBuffer);
-    clview.meshesBuffer = cl::Buffer(context, clmeshes.begin(),
-                                    clmeshes.end(), true);
+    clview.instancesBuffer = cl::Buffer(context, instances.begin(),
+                                        instances.end(), true);
+    clview.geometriesBuffer = cl::Buffer(context, clgeometries.begin(),
+                                         clgeometries.end(), true);
+    clview.bvhInstancesBuffer = cl::Buffer(context, bvh_instances.begin(),
+                                           bvh_instances.end(), true);
     clview.bvhBuffer = cl::Buffer(context, bvh.begin(),
                                  bvh.end(), true);
-}
-
-std::vector<unsigned char> load_texture(const std::string & filename)
-{
-    std::vector<unsigned char> pixels;
-    unsigned int width, height;
-    lodepng::decode(pixels, width, height, filename.c_str());
-    return pixels;
+    instance_capacity = instances.size();
+    geometry_capacity = clgeometries.size();
+    bvh_capacity = bvh.size();
+    bvh_instance_capacity = bvh_instances.size();
+    if (precomputed_triangles) {
+        clview.trianglesBuffer = cl::Buffer(context, vertex_flags | CL_MEM_COPY_HOST_PTR,
+                                            triangle_size, const_cast<void*>(triangle_data));
+    } else {
+        clview.trianglesBuffer = cl::Buffer(context, CL_MEM_READ_ONLY,
+                                            sizeof(PrecomputedTriangle));
+    }
 }
 
 namespace YAML {
@@ -170,7 +1211,7 @@ namespace YAML {
     template<>
     struct convert<Light> {
         static bool decode(const Node& node, Light& light) {
-            if (node.size() != 3) {
+            if (!node["color"] || !node["location"] || !node["radius"]) {
                 return false;
             }
 
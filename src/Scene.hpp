@@ -18,20 +18,78 @@
 
 #include <array>
 #include <cmath>
+#include <memory>
+#include <string>
 
+#include "Animation.hpp"
+#include "DirtyRanges.hpp"
 #include "Primitives.hpp"
+#include "RangeAllocator.hpp"
+#include "SceneGraph.hpp"
+#include "Skinning.hpp"
+#include "Textures.hpp"
+#include "VirtualTexture.hpp"
+
+// A mesh file loaded once into the scene-wide arrays. Every Instance of
+// it points at the same vertex and index range. Levels of detail are
+// geometries of their own, chained from the full mesh at lod_base through
+// lod_next; generated levels own no vertices and index their base's.
+struct Geometry {
+    std::string file;
+    cl_int base_vertex;
+    cl_int base_indice;
+    cl_int num_vertices;
+    cl_int num_indices;
+    cl_int lod_base;
+    cl_int lod_next;
+    AABB bounds;
+};
 
 class Scene {
 public:
     std::vector<Vertex> vertices;
+    std::vector<QuantizedVertex> quantized_vertices;
     std::vector<VertexAttributes> vertexAttributes;
     std::vector<Indice> indices;
     std::vector<Mesh> meshes;
-    std::vector<CLMesh> clmeshes;
+    std::vector<Instance> instances;
+    SceneGraph graph;
+    std::vector<Geometry> geometries;
+    std::vector<CLGeometry> clgeometries;
+    std::vector<AABB> world_bounds;
     std::vector<BVHNode> bvh;
+    std::vector<cl_int> bvh_instances;
+    std::vector<cl_int> bvh_parents;
+    std::vector<cl_int> instance_leaves;
+    std::vector<PrecomputedTriangle> triangles;
+    std::vector<Skin> skins;
+    std::vector<Skeleton> skeletons;
+    std::vector<SkinVertex> skin_vertices;
+    std::vector<cl_int2> skin_triangles;
+    std::vector<JointTransform> joint_transforms;
     std::vector<Light> lights;
     std::vector<Material> materials;
-    std::vector<unsigned char> diffuse_array;
+    Atlas diffuse_atlas;
+    bool compressed_textures;
+    bool quantized_positions;
+    bool precomputed_triangles;
+    bool virtual_textures;
+    float lod_size;
+    size_t selected_triangles;
+    std::vector<BC1Block> diffuse_blocks;
+    std::unique_ptr<VirtualTexture> virtual_diffuse;
+    std::unique_ptr<Skinner> skinner;
+
+    // Whoever changes an element of a mirrored array marks it here, and
+    // update() sends only the marked ranges.
+    DirtyRanges dirty_instances;
+    DirtyRanges dirty_lights;
+    DirtyRanges dirty_materials;
+    size_t uploaded_bytes;
+
+    // Bumped whenever a device buffer is reallocated or the instance or
+    // BVH node count changes, so renderers know to rebind the scene.
+    cl_uint layout_revision;
 
     struct GLView {
         GLuint vertexBuffer;
@@ -45,27 +103,70 @@ public:
         cl::Buffer lightsBuffer;
         cl::Buffer materialsBuffer;
         cl::Image2DArray diffuseBuffer;
+        cl::Buffer diffuseBlocksBuffer;
         cl::Buffer vertexBuffer;
         cl::Buffer vertexAttributesBuffer;
         cl::Buffer indicesBuffer;
-        cl::Buffer meshesBuffer;
+        cl::Buffer instancesBuffer;
+        cl::Buffer geometriesBuffer;
         cl::Buffer bvhBuffer;
+        cl::Buffer bvhInstancesBuffer;
+        cl::Buffer trianglesBuffer;
     };
 
     CLView clview;
 
     static Scene load(const std::string & filename, cl::Context context, 
                 cl::Device device, cl::CommandQueue queue);
+    // With tiles_only, a virtual textured atlas goes to the tile file
+    // instead of host memory, and an up to date tile file is reused.
+    static Scene read(const std::string & filename, bool tiles_only = false);
     void update();
 
+    // Runtime editing. Mesh data goes into sub-allocated ranges of device
+    // buffers that grow geometrically and instances go in and out of the
+    // BVH in place, so none of these reload the scene. Removing an
+    // instance moves the last instance into its index.
+    cl_int add_mesh(const std::string & file);
+    void remove_mesh(cl_int geometry);
+    cl_int add_instance(cl_int geometry, cl_int material, const Transform & placement);
+    void remove_instance(cl_int instance);
+
 private:
+    unsigned int cache_tiles;
     cl::Context context;
     cl::Device device;
     cl::CommandQueue queue;
 
+    DirtyRanges dirty_bvh;
+    DirtyRanges dirty_bvh_instances;
+    DirtyRanges dirty_geometries;
+    Animator animator;
+
+    // Used ranges of the vertex and index buffers, and the element
+    // capacities of every growable device buffer.
+    RangeAllocator vertex_ranges;
+    RangeAllocator indice_ranges;
+    std::vector<cl_int> free_geometries;
+    size_t vertex_capacity;
+    size_t indice_capacity;
+    size_t instance_capacity;
+    size_t geometry_capacity;
+    size_t bvh_capacity;
+    size_t bvh_instance_capacity;
+    size_t bvh_dead_nodes;
+
     Scene(cl::Context context, cl::Device device, cl::CommandQueue queue);
-    void init_clview();
-    void init_glview();
+    void select_lod(size_t i);
+    void pose_skins(float time);
+    void upload_changes();
+    void reserve_geometry();
+    void rebuild_bvh();
+    static Scene load_package(const std::string & filename, cl::Context context,
+                              cl::Device device, cl::CommandQueue queue);
+    void init_clview(const void* texture_data, size_t texture_size,
+                     const void* triangle_data, size_t triangle_size);
+    void init_glview(const void* vertex_data, size_t vertex_size,
+                     const void* attribute_data, size_t attribute_size,
+                     const void* indice_data, size_t indice_size);
 };
-
-std::vector<unsigned char> load_texture(const std::string & filename);
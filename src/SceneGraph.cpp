@@ -0,0 +1,126 @@
+#include "SceneGraph.hpp"
+
+#include <algorithm>
+
+Transform compose(const Transform& parent, const Transform& local)
+{
+    Transform world;
+    world.orientation = parent.orientation * local.orientation;
+    world.position = parent.position + parent.orientation * (local.position * parent.scale);
+    world.scale = parent.scale * local.scale;
+    return world;
+}
+
+void place(Instance& instance, const Transform& world)
+{
+    instance.orientation = world.orientation;
+    instance.position = {{ world.position.x, world.position.y, world.position.z }};
+    instance.scale = world.scale;
+}
+
+cl_int SceneGraph::add_node(cl_int parent, const Transform& local, cl_int instance)
+{
+    parents.push_back(parent);
+    subtree_sizes.push_back(1);
+    node_instances.push_back(instance);
+    if (instance >= 0) {
+        if (instance_nodes.size() <= (size_t)instance) {
+            instance_nodes.resize(instance + 1, -1);
+        }
+        instance_nodes[instance] = parents.size() - 1;
+    }
+    locals.push_back(local);
+    worlds.push_back(parent >= 0 ? compose(worlds[parent], local) : local);
+    return parents.size() - 1;
+}
+
+void SceneGraph::end_group(cl_int node)
+{
+    subtree_sizes[node] = parents.size() - node;
+}
+
+const Transform& SceneGraph::local(cl_int node) const
+{
+    return locals[node];
+}
+
+const Transform& SceneGraph::world(cl_int node) const
+{
+    return worlds[node];
+}
+
+void SceneGraph::set_local(cl_int node, const Transform& local)
+{
+    locals[node] = local;
+    changed.push_back(node);
+}
+
+void SceneGraph::remove_instance(cl_int instance, cl_int last)
+{
+    auto node_of = [this](cl_int i) {
+        return (size_t)i < instance_nodes.size() ? instance_nodes[i] : -1;
+    };
+    cl_int removed = node_of(instance);
+    cl_int moved = node_of(last);
+    if (removed >= 0) {
+        node_instances[removed] = -1;
+    }
+    if (moved >= 0 && instance != last) {
+        node_instances[moved] = instance;
+    }
+    if ((size_t)instance < instance_nodes.size()) {
+        instance_nodes[instance] = moved;
+    }
+    instance_nodes.resize(std::min(instance_nodes.size(), (size_t)last));
+}
+
+// Sorted, a changed node either starts a new subtree or lies inside the
+// last one walked, whose pass already covered it. Parents come before
+// their children, so one forward pass leaves every world transform of a
+// subtree composed onto an up to date parent. Instances are marked in
+// runs of consecutive indices; one moved in by a removal is out of order
+// and gets a range of its own instead of stretching the subtree's.
+size_t SceneGraph::update(std::vector<Instance>& instances, DirtyRanges& dirty_instances)
+{
+    std::sort(changed.begin(), changed.end());
+    size_t end = 0;
+    size_t updated = 0;
+    for (cl_int root : changed) {
+        if ((size_t)root < end) {
+            continue;
+        }
+        end = root + subtree_sizes[root];
+        cl_int first_instance = -1;
+        cl_int last_instance = -1;
+        for (size_t n = root; n < end; n++) {
+            cl_int parent = parents[n];
+            worlds[n] = parent >= 0 ? compose(worlds[parent], locals[n]) : locals[n];
+            cl_int i = node_instances[n];
+            if (i < 0) {
+                continue;
+            }
+            place(instances[i], worlds[n]);
+            instances[i].revision++;
+            if (first_instance >= 0 && i == last_instance + 1) {
+                last_instance = i;
+                continue;
+            }
+            if (first_instance >= 0) {
+                dirty_instances.mark(first_instance, last_instance - first_instance + 1);
+            }
+            first_instance = i;
+            last_instance = i;
+        }
+        if (first_instance >= 0) {
+            dirty_instances.mark(first_instance, last_instance - first_instance + 1);
+        }
+        updated += end - root;
+    }
+    changed.clear();
+    return updated;
+}
+
+size_t SceneGraph::size() const
+{
+    return parents.size();
+}
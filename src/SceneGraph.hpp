@@ -0,0 +1,55 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "DirtyRanges.hpp"
+#include "Primitives.hpp"
+
+// Uniformly scaled rigid placement, closed under composition like the
+// Instance record it ends up in.
+struct Transform {
+    glm::quat orientation;
+    glm::vec3 position;
+    float scale;
+};
+
+Transform compose(const Transform& parent, const Transform& local);
+void place(Instance& instance, const Transform& world);
+
+// Group and instance nodes in depth first order: a node's subtree is
+// itself and the subtree_size - 1 nodes after it. Instances are numbered
+// in the same order, so a subtree also covers one contiguous run of them
+// until a removal moves the last instance into the gap.
+// set_local() only records the node; update() recomputes the world
+// transforms of the outermost changed subtrees, once per frame.
+class SceneGraph {
+public:
+    // Nodes have to be added in depth first order, closing each group
+    // with end_group() once everything below it is in.
+    cl_int add_node(cl_int parent, const Transform& local, cl_int instance = -1);
+    void end_group(cl_int node);
+
+    const Transform& local(cl_int node) const;
+    const Transform& world(cl_int node) const;
+    void set_local(cl_int node, const Transform& local);
+
+    // Follows the scene's swap removal: the instance's node stays as an
+    // empty group and the node of the last instance takes its index.
+    void remove_instance(cl_int instance, cl_int last);
+
+    // Returns the number of nodes whose world transform was recomputed.
+    size_t update(std::vector<Instance>& instances, DirtyRanges& dirty_instances);
+    size_t size() const;
+
+private:
+    std::vector<cl_int> parents;
+    std::vector<cl_int> subtree_sizes;
+    std::vector<cl_int> node_instances;
+    std::vector<cl_int> instance_nodes;
+    std::vector<Transform> locals;
+    std::vector<Transform> worlds;
+    std::vector<cl_int> changed;
+};
@@ -0,0 +1,98 @@
+#include "ScenePackage.hpp"
+#include "Scene.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+static const char package_magic[8] = {'T', 'R', 'A', 'C', 'E', 'P', 'K', 'G'};
+
+bool is_package(const std::string& filename)
+{
+    const std::string extension = ".pack";
+    return filename.size() > extension.size()
+        && filename.compare(filename.size() - extension.size(),
+                            extension.size(), extension) == 0;
+}
+
+void write_package(const Scene& scene, const std::string& filename)
+{
+    if (scene.virtual_textures) {
+        std::cout << "Virtual textures are not packed, the package samples "
+                     "the whole atlas" << std::endl;
+    }
+
+    PackageHeader header = {};
+    std::memcpy(header.magic, package_magic, sizeof(package_magic));
+    header.version = package_version;
+    header.flags = (scene.compressed_textures ? uint32_t(package_compressed_textures) : 0u)
+                 | (scene.quantized_positions ? uint32_t(package_quantized_positions) : 0u)
+                 | (scene.precomputed_triangles ? uint32_t(package_precomputed_triangles) : 0u);
+    header.atlas_page_size = scene.diffuse_atlas.page_size;
+    header.atlas_pages = scene.diffuse_atlas.pages;
+
+    const void* data[package_section_count];
+    auto section = [&](PackageSectionId id, const auto & vector) {
+        data[id] = vector.data();
+        header.sections[id].size = sizeof(vector[0]) * vector.size();
+    };
+    if (scene.quantized_positions) {
+        section(package_vertices, scene.quantized_vertices);
+    } else {
+        section(package_vertices, scene.vertices);
+    }
+    section(package_vertex_attributes, scene.vertexAttributes);
+    section(package_indices, scene.indices);
+    section(package_instances, scene.instances);
+    section(package_geometries, scene.clgeometries);
+    section(package_bvh, scene.bvh);
+    section(package_bvh_instances, scene.bvh_instances);
+    section(package_lights, scene.lights);
+    section(package_materials, scene.materials);
+    section(package_triangles, scene.triangles);
+    if (scene.compressed_textures) {
+        section(package_textures, scene.diffuse_blocks);
+    } else {
+        section(package_textures, scene.diffuse_atlas.pixels);
+    }
+
+    uint64_t offset = sizeof(PackageHeader);
+    for (auto & s : header.sections) {
+        s.offset = (offset + package_alignment - 1) / package_alignment * package_alignment;
+        offset = s.offset + s.size;
+    }
+
+    std::ofstream file(filename, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        throw std::runtime_error("Can't open " + filename + " for writing");
+    }
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (int i = 0; i < package_section_count; i++) {
+        file.seekp(header.sections[i].offset);
+        file.write(static_cast<const char*>(data[i]), header.sections[i].size);
+    }
+    if (!file) {
+        throw std::runtime_error("Failed writing " + filename);
+    }
+    std::cout << "Wrote " << filename << " (" << offset / 1024 << " KiB)" << std::endl;
+}
+
+const PackageHeader& read_package_header(const char* data, size_t size)
+{
+    auto header = reinterpret_cast<const PackageHeader*>(data);
+    if (size < sizeof(PackageHeader)
+     || std::memcmp(header->magic, package_magic, sizeof(package_magic)) != 0) {
+        throw std::runtime_error("Not a scene package");
+    }
+    if (header->version != package_version) {
+        throw std::runtime_error("Scene package version " + std::to_string(header->version)
+                                 + ", expected " + std::to_string(package_version));
+    }
+    for (auto & s : header->sections) {
+        if (s.size > 0 && (s.offset % package_alignment != 0 || s.offset + s.size > size)) {
+            throw std::runtime_error("Truncated scene package");
+        }
+    }
+    return *header;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+class Scene;
+
+// A packed scene is a header followed by the arrays Scene::load would
+// otherwise build, in the exact layout the device buffers use. Sections
+// start on page boundaries so the driver can read them out of the mapping.
+const uint32_t package_version = 3;
+const size_t package_alignment = 4096;
+
+enum PackageFlags : uint32_t {
+    package_compressed_textures = 1,
+    package_quantized_positions = 2,
+    package_precomputed_triangles = 4
+};
+
+enum PackageSectionId {
+    package_vertices,
+    package_vertex_attributes,
+    package_indices,
+    package_instances,
+    package_geometries,
+    package_bvh,
+    package_bvh_instances,
+    package_lights,
+    package_materials,
+    package_triangles,
+    package_textures,
+    package_section_count
+};
+
+struct PackageSection {
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct PackageHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t atlas_page_size;
+    uint32_t atlas_pages;
+    PackageSection sections[package_section_count];
+};
+
+bool is_package(const std::string& filename);
+void write_package(const Scene& scene, const std::string& filename);
+const PackageHeader& read_package_header(const char* data, size_t size);
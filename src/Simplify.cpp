@@ -0,0 +1,231 @@
+#include "Simplify.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+
+namespace {
+
+// Sum of squared distances to a set of planes, weighted by triangle area,
+// as the upper triangle of a symmetric 4x4 matrix.
+struct Quadric {
+    double q[10];
+    double weight;
+
+    Quadric()
+        : q()
+        , weight(0.0)
+    {}
+
+    void add_plane(double a, double b, double c, double d, double w)
+    {
+        const double p[4] = { a, b, c, d };
+        int k = 0;
+        for (int i = 0; i < 4; i++) {
+            for (int j = i; j < 4; j++) {
+                q[k++] += w * p[i] * p[j];
+            }
+        }
+        weight += w;
+    }
+
+    void add(const Quadric& other)
+    {
+        for (int k = 0; k < 10; k++) {
+            q[k] += other.q[k];
+        }
+        weight += other.weight;
+    }
+
+    double error(const cl_float3& p) const
+    {
+        const double x = p.s[0], y = p.s[1], z = p.s[2];
+        double e = q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+                 + q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+                 + q[7] * z * z + 2.0 * q[8] * z
+                 + q[9];
+        return std::max(e, 0.0);
+    }
+};
+
+struct Collapse {
+    double cost;
+    Indice from;
+    Indice to;
+    unsigned int from_version;
+    unsigned int to_version;
+
+    bool operator<(const Collapse& other) const
+    {
+        return cost > other.cost;
+    }
+};
+
+void cross(const cl_float3& a, const cl_float3& b, const cl_float3& c, double n[3])
+{
+    double e1[3], e2[3];
+    for (int j = 0; j < 3; j++) {
+        e1[j] = b.s[j] - a.s[j];
+        e2[j] = c.s[j] - a.s[j];
+    }
+    n[0] = e1[1] * e2[2] - e1[2] * e2[1];
+    n[1] = e1[2] * e2[0] - e1[0] * e2[2];
+    n[2] = e1[0] * e2[1] - e1[1] * e2[0];
+}
+
+}
+
+float simplify(const Vertex* vertices, size_t num_vertices,
+               const Indice* indices, size_t num_indices,
+               size_t target_indices, std::vector<Indice>& simplified)
+{
+    const size_t num_triangles = num_indices / 3;
+    std::vector<Indice> corners(indices, indices + num_triangles * 3);
+    std::vector<bool> live(num_triangles, true);
+    std::vector<std::vector<size_t>> triangles(num_vertices);
+    std::vector<Quadric> quadrics(num_vertices);
+    std::unordered_map<uint64_t, int> edges;
+    size_t live_triangles = 0;
+
+    auto position = [&](Indice v) -> const cl_float3& { return vertices[v].position; };
+    auto edge_key = [](Indice a, Indice b) {
+        return (uint64_t)std::min(a, b) << 32 | std::max(a, b);
+    };
+
+    for (size_t t = 0; t < num_triangles; t++) {
+        Indice* c = &corners[t * 3];
+        if (c[0] == c[1] || c[1] == c[2] || c[0] == c[2]) {
+            live[t] = false;
+            continue;
+        }
+        live_triangles++;
+        double n[3];
+        cross(position(c[0]), position(c[1]), position(c[2]), n);
+        double area = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+        for (int k = 0; k < 3; k++) {
+            triangles[c[k]].push_back(t);
+            edges[edge_key(c[k], c[(k + 1) % 3])]++;
+        }
+        if (area == 0.0) {
+            continue;
+        }
+        double d = -(n[0] * position(c[0]).s[0] + n[1] * position(c[0]).s[1]
+                   + n[2] * position(c[0]).s[2]) / area;
+        for (int k = 0; k < 3; k++) {
+            quadrics[c[k]].add_plane(n[0] / area, n[1] / area, n[2] / area, d, area * 0.5);
+        }
+    }
+
+    // Open and non-manifold edges pin both their vertices.
+    std::vector<bool> locked(num_vertices, false);
+    for (auto & edge : edges) {
+        if (edge.second != 2) {
+            locked[edge.first >> 32] = true;
+            locked[edge.first & 0xffffffff] = true;
+        }
+    }
+
+    std::vector<unsigned int> version(num_vertices, 0);
+    std::vector<bool> removed(num_vertices, false);
+    std::priority_queue<Collapse> heap;
+    auto push = [&](Indice from, Indice to) {
+        if (locked[from] || removed[from] || removed[to] || from == to) {
+            return;
+        }
+        Quadric q = quadrics[from];
+        q.add(quadrics[to]);
+        heap.push({ q.error(position(to)) / std::max(q.weight, 1e-12),
+                    from, to, version[from], version[to] });
+    };
+    for (size_t t = 0; t < num_triangles; t++) {
+        if (!live[t]) {
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            push(corners[t * 3 + k], corners[t * 3 + (k + 1) % 3]);
+            push(corners[t * 3 + (k + 1) % 3], corners[t * 3 + k]);
+        }
+    }
+
+    double max_error = 0.0;
+    while (live_triangles * 3 > target_indices && !heap.empty()) {
+        Collapse collapse = heap.top();
+        heap.pop();
+        Indice u = collapse.from;
+        Indice v = collapse.to;
+        if (removed[u] || removed[v]
+         || collapse.from_version != version[u] || collapse.to_version != version[v]) {
+            continue;
+        }
+
+        // Moving u onto v must not turn any surviving triangle over.
+        bool flips = false;
+        for (size_t t : triangles[u]) {
+            const Indice* c = &corners[t * 3];
+            if (!live[t] || c[0] == v || c[1] == v || c[2] == v) {
+                continue;
+            }
+            const cl_float3* p[3];
+            double before[3], after[3];
+            for (int k = 0; k < 3; k++) {
+                p[k] = &position(c[k]);
+            }
+            cross(*p[0], *p[1], *p[2], before);
+            for (int k = 0; k < 3; k++) {
+                p[k] = &position(c[k] == u ? v : c[k]);
+            }
+            cross(*p[0], *p[1], *p[2], after);
+            if (before[0] * after[0] + before[1] * after[1] + before[2] * after[2] <= 0.0) {
+                flips = true;
+                break;
+            }
+        }
+        if (flips) {
+            continue;
+        }
+
+        for (size_t t : triangles[u]) {
+            Indice* c = &corners[t * 3];
+            if (!live[t]) {
+                continue;
+            }
+            if (c[0] == v || c[1] == v || c[2] == v) {
+                live[t] = false;
+                live_triangles--;
+                continue;
+            }
+            for (int k = 0; k < 3; k++) {
+                if (c[k] == u) {
+                    c[k] = v;
+                }
+            }
+            triangles[v].push_back(t);
+        }
+        std::vector<size_t>().swap(triangles[u]);
+        auto & around = triangles[v];
+        around.erase(std::remove_if(around.begin(), around.end(),
+                                    [&](size_t t) { return !live[t]; }), around.end());
+        quadrics[v].add(quadrics[u]);
+        removed[u] = true;
+        version[v]++;
+        max_error = std::max(max_error, collapse.cost);
+
+        for (size_t t : triangles[v]) {
+            for (int k = 0; k < 3; k++) {
+                Indice x = corners[t * 3 + k];
+                push(x, v);
+                push(v, x);
+            }
+        }
+    }
+
+    simplified.clear();
+    for (size_t t = 0; t < num_triangles; t++) {
+        if (live[t]) {
+            simplified.insert(simplified.end(), &corners[t * 3], &corners[t * 3 + 3]);
+        }
+    }
+    return std::sqrt(max_error);
+}
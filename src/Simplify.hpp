@@ -0,0 +1,14 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+#include "Primitives.hpp"
+
+// Quadric error edge collapse that only moves vertices onto neighbouring
+// vertices, so a level keeps indexing the vertices of the mesh it came
+// from. Vertices on open edges, which includes every texture seam of an
+// IQM mesh, stay in place. Returns the largest position error introduced.
+float simplify(const Vertex* vertices, size_t num_vertices,
+               const Indice* indices, size_t num_indices,
+               size_t target_indices, std::vector<Indice>& simplified);
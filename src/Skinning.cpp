@@ -0,0 +1,141 @@
+#include "Skinning.hpp"
+#include "ProgramBuilder.hpp"
+#include "Utils.hpp"
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+int Skeleton::animation(const std::string& name) const
+{
+    for (size_t a = 0; a < animations.size(); a++) {
+        if (animations[a].name == name) {
+            return a;
+        }
+    }
+    throw std::runtime_error("No skeletal animation named " + name);
+}
+
+// Blends the two frames around time, chains every joint onto its parent
+// and folds in the inverse bind pose, so the rows take bind pose vertices
+// straight to posed ones.
+void pose_skeleton(const Skeleton& skeleton, int animation, float time,
+                   JointTransform* joints)
+{
+    const size_t num_joints = skeleton.parents.size();
+    const SkeletalAnimation & anim = skeleton.animations[animation];
+    float frame = std::max(time, 0.0f) * anim.framerate;
+    unsigned int a = (unsigned int)frame;
+    float t = frame - a;
+    unsigned int b;
+    if (anim.loop) {
+        a %= anim.num_frames;
+        b = (a + 1) % anim.num_frames;
+    } else {
+        a = std::min(a, anim.num_frames - 1);
+        b = std::min(a + 1, anim.num_frames - 1);
+    }
+    const JointPose* from = &skeleton.frames[(anim.first_frame + a) * num_joints];
+    const JointPose* to = &skeleton.frames[(anim.first_frame + b) * num_joints];
+
+    std::vector<glm::mat4> global(num_joints);
+    for (size_t j = 0; j < num_joints; j++) {
+        glm::mat4 local = glm::translate(glm::mat4(1.0f),
+                                         glm::mix(from[j].translate, to[j].translate, t))
+                        * glm::mat4_cast(glm::slerp(from[j].rotate, to[j].rotate, t))
+                        * glm::scale(glm::mat4(1.0f), glm::mix(from[j].scale, to[j].scale, t));
+        int parent = skeleton.parents[j];
+        global[j] = parent >= 0 ? global[parent] * local : local;
+        glm::mat4 m = global[j] * skeleton.inverse_bind[j];
+        for (int r = 0; r < 3; r++) {
+            joints[j].rows[r] = {{ m[0][r], m[1][r], m[2][r], m[3][r] }};
+        }
+    }
+}
+
+// A skinned vertex is a convex blend of its joints' transforms applied to
+// it, so it stays inside the union of every joint's bind pose bounds taken
+// through that joint. Conservative, and no read back of the vertices.
+AABB skinned_bounds(const Skeleton& skeleton, const JointTransform* joints)
+{
+    AABB bounds = skeleton.unskinned_bounds;
+    for (size_t j = 0; j < skeleton.joint_bounds.size(); j++) {
+        const AABB & b = skeleton.joint_bounds[j];
+        if (b.min.s[0] > b.max.s[0]) {
+            continue;
+        }
+        for (int corner = 0; corner < 8; corner++) {
+            float p[3] = { (corner & 1 ? b.max : b.min).s[0],
+                           (corner & 2 ? b.max : b.min).s[1],
+                           (corner & 4 ? b.max : b.min).s[2] };
+            for (int r = 0; r < 3; r++) {
+                const cl_float4 & row = joints[j].rows[r];
+                float v = row.s[0] * p[0] + row.s[1] * p[1] + row.s[2] * p[2] + row.s[3];
+                bounds.min.s[r] = std::min(bounds.min.s[r], v);
+                bounds.max.s[r] = std::max(bounds.max.s[r], v);
+            }
+        }
+    }
+    return bounds;
+}
+
+Skinner::Skinner(cl::Context context, cl::Device device, cl::CommandQueue queue,
+                 const std::vector<SkinVertex>& vertices, const std::vector<cl_int2>& triangles,
+                 size_t num_joints)
+    : context(context)
+    , queue(queue)
+    , num_vertices(vertices.size())
+    , num_triangles(triangles.size())
+{
+    std::vector<std::string> sources;
+    for (auto name : { "skinning.cl", "primitives.cl", "quaternion.cl" }) {
+        sources.push_back(file_to_str(kernels_dir + name));
+    }
+    program = build_program(context, device, sources, read_headers(kernels_dir),
+                            "-cl-mad-enable -cl-std=CL1.2 -I " + kernels_dir);
+    skin_krnl = cl::Kernel(program, "skin");
+    triangles_krnl = cl::Kernel(program, "skinTriangles");
+
+    vertices_buffer = cl::Buffer(context, vertices.begin(), vertices.end(), true);
+    if (triangles.empty()) {
+        triangles_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(cl_int2));
+    } else {
+        triangles_buffer = cl::Buffer(context, triangles.begin(), triangles.end(), true);
+    }
+    joints_buffer = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(JointTransform) * num_joints);
+}
+
+// Returns the bytes uploaded, which is only the joint transforms; the
+// vertices never leave the device.
+size_t Skinner::skin(const std::vector<JointTransform>& joints, const cl::Buffer& vertices,
+                     const cl::Buffer& vertex_attributes, const cl::Buffer& indices,
+                     const cl::Buffer* triangles)
+{
+    const size_t joint_bytes = sizeof(JointTransform) * joints.size();
+    queue.enqueueWriteBuffer(joints_buffer, CL_FALSE, 0, joint_bytes, joints.data());
+
+    std::vector<cl::Memory> mem_objs = {vertices, vertex_attributes, indices};
+    glFlush();
+    queue.enqueueAcquireGLObjects(&mem_objs, nullptr);
+    skin_krnl.setArg(0, vertices_buffer);
+    skin_krnl.setArg(1, joints_buffer);
+    skin_krnl.setArg(2, vertices);
+    skin_krnl.setArg(3, vertex_attributes);
+    queue.enqueueNDRangeKernel(skin_krnl, cl::NullRange,
+                               cl::NDRange(num_vertices), cl::NullRange);
+    if (triangles && num_triangles > 0) {
+        triangles_krnl.setArg(0, triangles_buffer);
+        triangles_krnl.setArg(1, vertices);
+        triangles_krnl.setArg(2, indices);
+        triangles_krnl.setArg(3, *triangles);
+        queue.enqueueNDRangeKernel(triangles_krnl, cl::NullRange,
+                                   cl::NDRange(num_triangles), cl::NullRange);
+    }
+    queue.enqueueReleaseGLObjects(&mem_objs, nullptr);
+    queue.finish();
+    return joint_bytes;
+}
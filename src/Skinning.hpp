@@ -0,0 +1,106 @@
+#pragma once
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#include <OpenCL/cl_platform.h>
+#elif defined __linux__
+#include <CL/cl.h>
+#include <CL/cl_platform.h>
+#endif
+
+#include "cl.hpp"
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+
+#include "Primitives.hpp"
+
+// Bind pose position and normal of one vertex of a skinned copy, the four
+// joints moving it and where the skinned result goes in the scene arrays.
+// Joint indexes are absolute into the scene's joint transforms.
+struct SkinVertex {
+    cl_float3 position;
+    cl_float3 normal;
+    cl_ushort4 joints;
+    cl_uchar4 weights;
+    cl_int target;
+};
+
+// Rows of the 3x4 matrix taking a bind pose vertex to its posed position.
+struct JointTransform {
+    cl_float4 rows[3];
+};
+
+struct JointPose {
+    glm::vec3 translate;
+    glm::quat rotate;
+    glm::vec3 scale;
+};
+
+struct SkeletalAnimation {
+    std::string name;
+    unsigned int first_frame;
+    unsigned int num_frames;
+    float framerate;
+    bool loop;
+};
+
+// Joints in IQM order, parents always before their children. frames holds
+// num_frames * joints poses, joint_bounds the bind pose bounds of the
+// vertices each joint moves and unskinned_bounds those no joint moves.
+struct Skeleton {
+    std::vector<int> parents;
+    std::vector<glm::mat4> inverse_bind;
+    std::vector<JointPose> frames;
+    std::vector<SkeletalAnimation> animations;
+    std::vector<AABB> joint_bounds;
+    AABB unskinned_bounds;
+
+    int animation(const std::string& name) const;
+};
+
+// One animated copy of a skeletal mesh, with its own geometry slot.
+struct Skin {
+    cl_int instance;
+    cl_int geometry;
+    cl_int skeleton;
+    cl_int animation;
+    cl_int first_joint;
+    float speed;
+};
+
+void pose_skeleton(const Skeleton& skeleton, int animation, float time,
+                   JointTransform* joints);
+AABB skinned_bounds(const Skeleton& skeleton, const JointTransform* joints);
+
+// Deforms every skinned copy on the device, straight into the shared
+// vertex buffers, and rebuilds the precomputed triangles of the copies
+// when the scene uses them.
+class Skinner {
+public:
+    Skinner(cl::Context context, cl::Device device, cl::CommandQueue queue,
+            const std::vector<SkinVertex>& vertices, const std::vector<cl_int2>& triangles,
+            size_t num_joints);
+    size_t skin(const std::vector<JointTransform>& joints, const cl::Buffer& vertices,
+                const cl::Buffer& vertex_attributes, const cl::Buffer& indices,
+                const cl::Buffer* triangles);
+
+private:
+    cl::Context context;
+    cl::CommandQueue queue;
+
+    cl::Program program;
+    cl::Kernel skin_krnl;
+    cl::Kernel triangles_krnl;
+
+    cl::Buffer vertices_buffer;
+    cl::Buffer triangles_buffer;
+    cl::Buffer joints_buffer;
+    size_t num_vertices;
+    size_t num_triangles;
+
+    const std::string kernels_dir = "../src/kernels/";
+};
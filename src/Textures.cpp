@@ -0,0 +1,301 @@
+#include "Textures.hpp"
+#include "Utils.hpp"
+
+#include "lodepng.h"
+
+#define STBRP_STATIC
+#define STB_RECT_PACK_IMPLEMENTATION
+#include "stb_rect_pack.h"
+
+#include <algorithm>
+#include <iostream>
+#include <stdexcept>
+
+Texture load_texture(const std::string & filename)
+{
+    Texture texture;
+    unsigned int error = lodepng::decode(texture.pixels, texture.width,
+                                         texture.height, filename.c_str());
+    if (error) {
+        throw std::runtime_error(filename + ": " + lodepng_error_text(error));
+    }
+    return texture;
+}
+
+// Levels are counted down to the smaller side reaching one texel, which
+// keeps the stacked tail of mip_layout within the height of level 0.
+unsigned int mip_levels(unsigned int width, unsigned int height)
+{
+    unsigned int levels = 1;
+    while (std::min(width, height) >> levels) {
+        levels++;
+    }
+    return levels;
+}
+
+// 2x2 box filter, odd edges repeat their last texel.
+Texture downsample(const Texture & texture)
+{
+    Texture level;
+    level.width = std::max(texture.width / 2, 1u);
+    level.height = std::max(texture.height / 2, 1u);
+    level.pixels.resize(level.width * level.height * 4);
+
+    for (unsigned int y = 0; y < level.height; y++) {
+        unsigned int y0 = std::min(y * 2, texture.height - 1);
+        unsigned int y1 = std::min(y * 2 + 1, texture.height - 1);
+        for (unsigned int x = 0; x < level.width; x++) {
+            unsigned int x0 = std::min(x * 2, texture.width - 1);
+            unsigned int x1 = std::min(x * 2 + 1, texture.width - 1);
+            for (unsigned int c = 0; c < 4; c++) {
+                unsigned int sum = texture.pixels[(y0 * texture.width + x0) * 4 + c]
+                                 + texture.pixels[(y0 * texture.width + x1) * 4 + c]
+                                 + texture.pixels[(y1 * texture.width + x0) * 4 + c]
+                                 + texture.pixels[(y1 * texture.width + x1) * 4 + c];
+                level.pixels[(y * level.width + x) * 4 + c] = (sum + 2) / 4;
+            }
+        }
+    }
+    return level;
+}
+
+// Lays out the full mip chain of a texture in a single image that is one
+// and a half times as wide: level 0 on the left, the smaller levels stacked
+// on top of each other in the column to its right. The kernel derives the
+// rectangle of a level from the size of level 0 alone.
+Texture mip_layout(const Texture & texture)
+{
+    Texture layout;
+    layout.width = texture.width + std::max(texture.width / 2, 1u);
+    layout.height = texture.height;
+    layout.pixels.resize(layout.width * layout.height * 4, 0);
+
+    auto blit = [&layout](const Texture & level, unsigned int ox, unsigned int oy) {
+        for (unsigned int y = 0; y < level.height; y++) {
+            std::copy_n(&level.pixels[y * level.width * 4], level.width * 4,
+                        &layout.pixels[((oy + y) * layout.width + ox) * 4]);
+        }
+    };
+
+    blit(texture, 0, 0);
+
+    Texture level = texture;
+    for (unsigned int l = 1; l < mip_levels(texture.width, texture.height); l++) {
+        level = downsample(level);
+        blit(level, texture.width, texture.height - (texture.height >> (l - 1)));
+    }
+    return layout;
+}
+
+// Copies a mip layout into a page and repeats its border texels into the
+// surrounding padding, so filtering at the edge of a region never picks up
+// its neighbours.
+static void blit_padded(const Texture & layout, unsigned int padding,
+                        unsigned char* page, unsigned int page_size,
+                        unsigned int ox, unsigned int oy)
+{
+    unsigned int width = layout.width + padding * 2;
+    unsigned int height = layout.height + padding * 2;
+    for (unsigned int y = 0; y < height; y++) {
+        unsigned int sy = std::min(std::max(y, padding) - padding, layout.height - 1);
+        for (unsigned int x = 0; x < width; x++) {
+            unsigned int sx = std::min(std::max(x, padding) - padding, layout.width - 1);
+            std::copy_n(&layout.pixels[(sy * layout.width + sx) * 4], 4,
+                        &page[((oy + y) * page_size + ox + x) * 4]);
+        }
+    }
+}
+
+// Returns the top-left corner of each padded layout and the number of
+// pages used.
+static std::vector<AtlasRegion> pack_pages(const std::vector<Texture> & layouts,
+                                           unsigned int page_size,
+                                           unsigned int padding,
+                                           unsigned int & pages)
+{
+    std::vector<stbrp_rect> rects(layouts.size());
+    for (size_t i = 0; i < layouts.size(); i++) {
+        rects[i].id = i;
+        rects[i].w = layouts[i].width + padding * 2;
+        rects[i].h = layouts[i].height + padding * 2;
+        rects[i].was_packed = 0;
+    }
+
+    std::vector<AtlasRegion> regions(layouts.size());
+    std::vector<stbrp_node> nodes(page_size);
+    for (pages = 0; !rects.empty(); pages++) {
+        stbrp_context ctx;
+        stbrp_init_target(&ctx, page_size, page_size, nodes.data(), nodes.size());
+        stbrp_pack_rects(&ctx, rects.data(), rects.size());
+
+        auto unpacked = std::partition(rects.begin(), rects.end(),
+                                       [](const stbrp_rect & r) { return r.was_packed; });
+        if (unpacked == rects.begin()) {
+            throw std::runtime_error("texture does not fit in an atlas page");
+        }
+        for (auto r = rects.begin(); r != unpacked; r++) {
+            regions[r->id] = { pages, r->x, r->y };
+        }
+        rects.erase(rects.begin(), unpacked);
+    }
+    return regions;
+}
+
+// Packs the mip layouts of all textures into square pages. Textures larger
+// than a page, or whose pages would exceed the byte budget, lose their
+// largest level until everything fits; the caller's textures are replaced
+// by the downsampled versions.
+Atlas pack_atlas(std::vector<Texture> & textures, unsigned int page_size,
+                 unsigned int padding, size_t budget)
+{
+    // A 1x1 texture and its padding have to fit, or downsampling never ends.
+    if (page_size < 2 + padding * 2) {
+        throw std::runtime_error("atlas page size " + std::to_string(page_size)
+                                 + " is too small for a padding of "
+                                 + std::to_string(padding));
+    }
+    const size_t page_bytes = size_t(page_size) * page_size * 4;
+
+    auto largest = [&textures]() {
+        return std::max_element(textures.begin(), textures.end(),
+                                [](const Texture & a, const Texture & b) {
+                                    return a.width * a.height < b.width * b.height;
+                                });
+    };
+
+    for (auto & texture : textures) {
+        while (texture.width + std::max(texture.width / 2, 1u) + padding * 2 > page_size
+            || texture.height + padding * 2 > page_size) {
+            texture = downsample(texture);
+        }
+    }
+
+    Atlas atlas;
+    atlas.page_size = page_size;
+    std::vector<Texture> layouts;
+    for (;;) {
+        layouts.clear();
+        for (auto & texture : textures) {
+            layouts.push_back(mip_layout(texture));
+        }
+        atlas.regions = pack_pages(layouts, page_size, padding, atlas.pages);
+        if (atlas.pages * page_bytes <= budget || atlas.pages <= 1) {
+            break;
+        }
+        auto texture = largest();
+        if (texture->width == 1 && texture->height == 1) {
+            break;
+        }
+        if (verbose) {
+            std::cerr << "texture budget exceeded, downsampling "
+                      << texture->width << "x" << texture->height
+                      << " texture" << std::endl;
+        }
+        *texture = downsample(*texture);
+    }
+    // A scene without materials still gets one blank page, an image array
+    // needs at least one layer.
+    atlas.pages = std::max(atlas.pages, 1u);
+
+    atlas.pixels.resize(atlas.pages * page_bytes, 0);
+    for (size_t i = 0; i < layouts.size(); i++) {
+        auto & region = atlas.regions[i];
+        blit_padded(layouts[i], padding,
+                    &atlas.pixels[region.page * page_bytes], page_size,
+                    region.x, region.y);
+        region.x += padding;
+        region.y += padding;
+    }
+    return atlas;
+}
+
+static uint16_t pack_565(const unsigned int c[3])
+{
+    return ((c[0] * 31 + 127) / 255) << 11
+         | ((c[1] * 63 + 127) / 255) << 5
+         | ((c[2] * 31 + 127) / 255);
+}
+
+static void unpack_565(uint16_t p, int c[3])
+{
+    c[0] = ((p >> 11) & 31) * 255 / 31;
+    c[1] = ((p >> 5) & 63) * 255 / 63;
+    c[2] = (p & 31) * 255 / 31;
+}
+
+// Range fit: endpoints are the per-channel bounds of the block, inset by a
+// sixteenth, and every texel takes the nearest of the four palette colors.
+static BC1Block encode_block(const unsigned char* texels, unsigned int stride)
+{
+    unsigned int lo[3] = { 255, 255, 255 };
+    unsigned int hi[3] = { 0, 0, 0 };
+    for (unsigned int y = 0; y < 4; y++) {
+        for (unsigned int x = 0; x < 4; x++) {
+            const unsigned char* t = &texels[(y * stride + x) * 4];
+            for (int c = 0; c < 3; c++) {
+                lo[c] = std::min<unsigned int>(lo[c], t[c]);
+                hi[c] = std::max<unsigned int>(hi[c], t[c]);
+            }
+        }
+    }
+    for (int c = 0; c < 3; c++) {
+        unsigned int inset = (hi[c] - lo[c]) / 16;
+        lo[c] += inset;
+        hi[c] -= inset;
+    }
+
+    BC1Block block;
+    block.color0 = pack_565(hi);
+    block.color1 = pack_565(lo);
+    block.indices = 0;
+    if (block.color0 == block.color1) {
+        return block;
+    }
+
+    int palette[4][3];
+    unpack_565(block.color0, palette[0]);
+    unpack_565(block.color1, palette[1]);
+    for (int c = 0; c < 3; c++) {
+        palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+        palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+
+    for (unsigned int i = 0; i < 16; i++) {
+        const unsigned char* t = &texels[((i / 4) * stride + i % 4) * 4];
+        unsigned int best = 0;
+        int best_error = INT32_MAX;
+        for (unsigned int p = 0; p < 4; p++) {
+            int error = 0;
+            for (int c = 0; c < 3; c++) {
+                int d = t[c] - palette[p][c];
+                error += d * d;
+            }
+            if (error < best_error) {
+                best_error = error;
+                best = p;
+            }
+        }
+        block.indices |= best << (i * 2);
+    }
+    return block;
+}
+
+// Encodes all atlas pages, blocks are stored row by row, page after page.
+std::vector<BC1Block> encode_bc1(const Atlas & atlas)
+{
+    const unsigned int blocks_per_row = atlas.page_size / 4;
+    const size_t page_bytes = size_t(atlas.page_size) * atlas.page_size * 4;
+
+    std::vector<BC1Block> blocks;
+    blocks.reserve(size_t(atlas.pages) * blocks_per_row * blocks_per_row);
+    for (unsigned int page = 0; page < atlas.pages; page++) {
+        const unsigned char* pixels = &atlas.pixels[page * page_bytes];
+        for (unsigned int by = 0; by < blocks_per_row; by++) {
+            for (unsigned int bx = 0; bx < blocks_per_row; bx++) {
+                blocks.push_back(encode_block(&pixels[(by * 4 * atlas.page_size + bx * 4) * 4],
+                                              atlas.page_size));
+            }
+        }
+    }
+    return blocks;
+}
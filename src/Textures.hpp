@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct Texture {
+    unsigned int width;
+    unsigned int height;
+    std::vector<unsigned char> pixels;
+};
+
+struct AtlasRegion {
+    unsigned int page;
+    unsigned int x;
+    unsigned int y;
+};
+
+struct Atlas {
+    unsigned int page_size;
+    unsigned int pages;
+    std::vector<AtlasRegion> regions;
+    std::vector<unsigned char> pixels;
+};
+
+// Matches the uint2 the kernel reads: x holds both 565 endpoints,
+// y the 2 bit texel indices.
+struct BC1Block {
+    uint16_t color0;
+    uint16_t color1;
+    uint32_t indices;
+};
+
+Texture load_texture(const std::string & filename);
+unsigned int mip_levels(unsigned int width, unsigned int height);
+Texture downsample(const Texture & texture);
+Texture mip_layout(const Texture & texture);
+Atlas pack_atlas(std::vector<Texture> & textures, unsigned int page_size,
+                 unsigned int padding, size_t budget);
+std::vector<BC1Block> encode_bc1(const Atlas & atlas);
@@ -4,8 +4,16 @@
 #include <GL/glx.h>
 #endif
 
+#include <dirent.h>
+
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <sstream>
 #include "Utils.hpp"
 
 Tracer::Tracer(cl::Context context, cl::Device device, cl::CommandQueue queue)
@@ -13,9 +21,18 @@ Tracer::Tracer(cl::Context context, cl::Device device, cl::CommandQueue queue)
     , device(device)
     , queue(queue)
     , current_scene(nullptr)
+    , bound_layout(0)
+    , ray_stats()
+    , ray_budget(1 << 20)
+    , frame(0)
+    , builder(context, device, kernels_dir,
+              std::vector<std::string>(kernel_filenames.begin(), kernel_filenames.end()))
+    , pending_options(false)
+    , kernel_watcher(kernels_dir)
 {
     auto max_group_size = device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
     group_size = std::sqrt(max_group_size);
+    stats_buffer = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(RayStats));
 }
 
 void CL_CALLBACK contextCallback(
@@ -29,19 +46,56 @@ void CL_CALLBACK contextCallback(
 
 void Tracer::load_kernels(Tracer::options & options)
 {
-    cl::Program::Sources sources;
+    current_options = options;
+    requested_options = options;
+    use_program(builder.build(build_options(options)));
+    request_variants();
+}
 
-    std::vector<std::string> src_strs;
+void Tracer::use_program(cl::Program ready)
+{
+    program = ready;
+    tracer_krnl = cl::Kernel(program, "tracer");
+    if (current_scene) {
+        set_tracer_kernel_args();
+    }
+    if (target_texture()) {
+        tracer_krnl.setArg(0, target_texture);
+        init_frame_buffers();
+    }
+}
 
-    for (auto & flnm : kernel_filenames) {
-        src_strs.push_back(file_to_str(kernels_dir + flnm));
+// Queues every display mode with and without shadows for the other current
+// options, so the common toggles find their program already built.
+void Tracer::request_variants()
+{
+    const display_options modes[] = { shaded, unlit, normals, texcoords, depth };
+    for (auto dspo : modes) {
+        for (bool shadows : { true, false }) {
+            options variant = current_options;
+            variant.dspo = dspo;
+            variant.shadows = shadows;
+            builder.request(build_options(variant));
+        }
     }
+}
 
-    for (auto & src : src_strs) {
-        sources.push_back({src.c_str(), src.length()});
+// Switches to the requested options once their program is built; until
+// then the current program keeps rendering.
+void Tracer::swap_ready_program()
+{
+    cl::Program ready;
+    if (!pending_options || !builder.ready(build_options(requested_options), ready)) {
+        return;
     }
+    current_options = requested_options;
+    pending_options = false;
+    use_program(ready);
+    request_variants();
+}
 
-    program = cl::Program(context, sources);
+std::string Tracer::build_options(const Tracer::options& options) const
+{
     std::string options_str("-DDISPLAY=");
     switch(options.dspo){
         case unlit:
@@ -65,53 +119,113 @@ void Tracer::load_kernels(Tracer::options & options)
     if(!options.shadows) {
         options_str.append(" -DNOSHADOWS");
     }
-    try {
-        program.build({device}, (options_str + " -cl-mad-enable -cl-std=CL1.2 -I " + kernels_dir).c_str());
-    } catch (cl::Error err) {
-        std::cerr << "error building: "
-                  << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device)
-                  << std::endl;
+
+    if(options.light_resampling) {
+        options_str.append(" -DLIGHT_RESAMPLING");
     }
-    tracer_krnl = cl::Kernel(program, "tracer");
+
+    options_str.append(" -DMAX_BOUNCES=" + std::to_string(options.bounces));
+
+    if(options.occluder_cache) {
+        options_str.append(" -DOCCLUDER_CACHE");
+    }
+
+    // Materials are only ever indexed through an instance, and every
+    // material has a diffuse texture, so the light count is the only
+    // scene constant a loop depends on.
+    if(options.specialize && current_scene) {
+        options_str.append(" -DSCENE_LIGHTS=" + std::to_string(current_scene->lights.size()));
+    }
+
+    if(current_scene && current_scene->compressed_textures) {
+        options_str.append(" -DCOMPRESSED_TEXTURES");
+    }
+
+    if(current_scene && current_scene->quantized_positions) {
+        options_str.append(" -DQUANTIZED_POSITIONS");
+    }
+
+    if(current_scene && current_scene->precomputed_triangles) {
+        options_str.append(" -DPRECOMPUTED_TRIANGLES");
+    }
+
+    if(current_scene && current_scene->virtual_diffuse) {
+        options_str.append(" -DVIRTUAL_TEXTURES"
+                           " -DTILE_SIZE=" + std::to_string(VirtualTexture::tile_size)
+                           + " -DTILE_BORDER=" + std::to_string(VirtualTexture::tile_border)
+                           + " -DCACHE_SLOTS_PER_ROW=" + std::to_string(VirtualTexture::slots_per_row));
+    }
+    options_str.append(" -cl-mad-enable -cl-std=CL1.2 -I " + kernels_dir);
+    return options_str;
 }
 
 void Tracer::set_scene(const Scene& scene)
 {
     current_scene = &scene;
-    set_tracer_kernel_args();
+    if (tracer_krnl()) {
+        builder.clear();
+        load_kernels(current_options);
+    }
 }
 
 void Tracer::set_options(Tracer::options& options)
 {
     if (options != current_options) {
-        current_options = options;
-        reload_kernels();
+        requested_options = options;
+        pending_options = true;
+        builder.request(build_options(options));
+        swap_ready_program();
+    } else if (requested_options != options) {
+        pending_options = false;
     }
 }
 
+// Rebuilds in the background; the current program keeps rendering until
+// the new one is ready, and stays if the build fails.
 void Tracer::reload_kernels()
 {
-    load_kernels(current_options);
-    set_tracer_kernel_args();
-    tracer_krnl.setArg(0, target_texture);
+    builder.clear();
+    if (!pending_options) {
+        requested_options = current_options;
+        pending_options = true;
+    }
+    builder.request(build_options(requested_options));
+}
+
+void Tracer::set_ray_budget(cl_uint budget)
+{
+    ray_budget = budget;
 }
 
 void Tracer::set_tracer_kernel_args()
 {    
+    bound_layout = current_scene->layout_revision;
     tracer_krnl.setArg(1, current_scene->clview.lightsBuffer);
     tracer_krnl.setArg(2, (cl_int)current_scene->lights.size());
 
     tracer_krnl.setArg(3, current_scene->clview.vertexBuffer);
     tracer_krnl.setArg(4, current_scene->clview.vertexAttributesBuffer);
     tracer_krnl.setArg(5, current_scene->clview.indicesBuffer);
-    tracer_krnl.setArg(6, current_scene->clview.meshesBuffer);
-    tracer_krnl.setArg(7, (cl_int)current_scene->clmeshes.size());
+    tracer_krnl.setArg(6, current_scene->clview.instancesBuffer);
+    tracer_krnl.setArg(7, (cl_int)current_scene->instances.size());
 
     tracer_krnl.setArg(8, current_scene->clview.bvhBuffer);
     tracer_krnl.setArg(9, (cl_int)current_scene->bvh.size());
 
     tracer_krnl.setArg(10, current_scene->clview.materialsBuffer);
     tracer_krnl.setArg(11, current_scene->clview.diffuseBuffer);
+    tracer_krnl.setArg(18, current_scene->clview.diffuseBlocksBuffer);
+    tracer_krnl.setArg(19, (cl_int)current_scene->diffuse_atlas.page_size);
+    if (current_scene->virtual_diffuse) {
+        tracer_krnl.setArg(20, current_scene->virtual_diffuse->page_table_buffer);
+        tracer_krnl.setArg(21, current_scene->virtual_diffuse->requests_buffer);
+    } else {
+        tracer_krnl.setArg(20, current_scene->clview.diffuseBlocksBuffer);
+        tracer_krnl.setArg(21, current_scene->clview.diffuseBlocksBuffer);
+    }
+    tracer_krnl.setArg(22, current_scene->clview.trianglesBuffer);
+    tracer_krnl.setArg(23, current_scene->clview.geometriesBuffer);
+    tracer_krnl.setArg(24, current_scene->clview.bvhInstancesBuffer);
 }
 
 void Tracer::set_texture(GLuint texid, int width, int height)
@@ -125,6 +239,7 @@ void Tracer::set_texture(GLuint texid, int width, int height)
                           0,
                           texid);
         tracer_krnl.setArg(0, target_texture);
+        init_frame_buffers();
     } catch (cl::Error err) {
         std::cerr << "Error setting texture kernel arg, "
                   << err.what()
@@ -133,15 +248,160 @@ void Tracer::set_texture(GLuint texid, int width, int height)
     }
 }
 
+void Tracer::init_frame_buffers()
+{
+    for (auto & reservoirs : reservoir_buffers) {
+        reservoirs = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                sizeof(Reservoir) * width * height);
+        queue.enqueueFillBuffer(reservoirs, (cl_uchar)0, 0,
+                                sizeof(Reservoir) * width * height);
+    }
+
+    // One entry per pixel and light, so no two lights share a slot.
+    size_t lights = current_scene ? std::max<size_t>(current_scene->lights.size(), 1) : 1;
+    size_t cache_entries = current_options.occluder_cache
+                         ? width * height * lights
+                         : 1;
+    occluder_cache = cl::Buffer(context, CL_MEM_READ_WRITE,
+                                sizeof(OccluderCacheEntry) * cache_entries);
+    queue.enqueueFillBuffer(occluder_cache, (cl_int)-1, 0,
+                            sizeof(OccluderCacheEntry) * cache_entries);
+}
+
 void Tracer::render()
+{
+    if (kernel_watcher.changed()) {
+        reload_kernels();
+    }
+    swap_ready_program();
+    // Runtime edits moved buffers or changed counts, which are kernel
+    // arguments even in scene specialised programs. Cached occluders may
+    // name instances that were swapped away.
+    if (current_scene->layout_revision != bound_layout) {
+        set_tracer_kernel_args();
+        queue.enqueueFillBuffer(occluder_cache, (cl_int)-1, 0,
+                                occluder_cache.getInfo<CL_MEM_SIZE>());
+    }
+    trace_frame();
+}
+
+// Runs the bound program for one frame, without swapping in programs
+// built in the background.
+void Tracer::trace_frame()
 {
     std::vector<cl::Memory> mem_objs = {target_texture};
     glFlush();
     queue.enqueueAcquireGLObjects(&mem_objs, nullptr);
+    tracer_krnl.setArg(12, reservoir_buffers[frame % 2]);
+    tracer_krnl.setArg(13, reservoir_buffers[(frame + 1) % 2]);
+    tracer_krnl.setArg(14, frame);
+    tracer_krnl.setArg(15, occluder_cache);
+    tracer_krnl.setArg(16, stats_buffer);
+    tracer_krnl.setArg(17, ray_budget);
+    if (current_options.bounces > 0) {
+        queue.enqueueFillBuffer(stats_buffer, (cl_uint)0, 0, sizeof(RayStats));
+    }
     queue.enqueueNDRangeKernel(tracer_krnl, cl::NullRange,
                                        cl::NDRange(width, height),
                                        cl::NDRange(group_size, group_size),
                                        nullptr);
     queue.enqueueReleaseGLObjects(&mem_objs, nullptr);
+    if (current_options.bounces > 0) {
+        queue.enqueueReadBuffer(stats_buffer, CL_FALSE, 0,
+                                sizeof(RayStats), &ray_stats);
+    }
     queue.finish();
+    frame++;
+}
+
+// Samples the diffuse atlas once as an RGBA8 image array and once as BC1
+// blocks decoded in the kernel, and reports the sampling rate of both.
+void Tracer::benchmark_textures()
+{
+    const Atlas & atlas = current_scene->diffuse_atlas;
+    if (atlas.pixels.empty()) {
+        std::cout << "Texture benchmark needs the atlas in host memory" << std::endl;
+        return;
+    }
+    std::vector<BC1Block> blocks = current_scene->compressed_textures
+                                 ? current_scene->diffuse_blocks
+                                 : encode_bc1(atlas);
+
+    cl::Image2DArray image(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+                           cl::ImageFormat(CL_RGBA, CL_UNORM_INT8), atlas.pages,
+                           atlas.page_size, atlas.page_size,
+                           0, 0, const_cast<unsigned char*>(atlas.pixels.data()));
+    cl::Buffer blocks_buffer(context, blocks.begin(), blocks.end(), true);
+
+    const int size = 1024;
+    const cl_int samples = 64;
+    const cl_int num_materials = current_scene->materials.size();
+    cl::Buffer result(context, CL_MEM_WRITE_ONLY, sizeof(cl_float4) * size * size);
+
+    cl::Kernel image_krnl(program, "benchmark_image");
+    image_krnl.setArg(0, image);
+    image_krnl.setArg(1, current_scene->clview.materialsBuffer);
+    image_krnl.setArg(2, num_materials);
+    image_krnl.setArg(3, samples);
+    image_krnl.setArg(4, result);
+
+    cl::Kernel blocks_krnl(program, "benchmark_blocks");
+    blocks_krnl.setArg(0, blocks_buffer);
+    blocks_krnl.setArg(1, (cl_int)atlas.page_size);
+    blocks_krnl.setArg(2, current_scene->clview.materialsBuffer);
+    blocks_krnl.setArg(3, num_materials);
+    blocks_krnl.setArg(4, samples);
+    blocks_krnl.setArg(5, result);
+
+    auto run = [&](cl::Kernel & kernel) {
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                   cl::NDRange(size, size), cl::NullRange);
+        queue.finish();
+        auto start = std::chrono::steady_clock::now();
+        queue.enqueueNDRangeKernel(kernel, cl::NullRange,
+                                   cl::NDRange(size, size), cl::NullRange);
+        queue.finish();
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        return double(size) * size * samples / elapsed.count() * 1e-9;
+    };
+
+    std::cout << "RGBA8: " << run(image_krnl) << " Gtexel/s, "
+              << atlas.pixels.size() / 1024 << " KiB" << std::endl;
+    std::cout << "BC1:   " << run(blocks_krnl) << " Gtexel/s, "
+              << sizeof(BC1Block) * blocks.size() / 1024 << " KiB" << std::endl;
+}
+
+// Traces the same frames with the generic and the scene specialised
+// program and prints the average frame time of each. Both are built
+// before timing starts, and programs finished in the background are not
+// swapped in until the next render.
+void Tracer::benchmark_specialization()
+{
+    const int frames = 32;
+    std::array<cl::Program, 2> variants;
+    try {
+        for (bool specialize : { false, true }) {
+            options variant = current_options;
+            variant.specialize = specialize;
+            variants[specialize] = builder.build(build_options(variant));
+        }
+    } catch (const BuildError& err) {
+        std::cerr << "Specialisation benchmark: " << err.what() << std::endl;
+        return;
+    }
+    cl::Program previous = program;
+
+    for (bool specialize : { false, true }) {
+        use_program(variants[specialize]);
+        trace_frame();
+        auto start = std::chrono::steady_clock::now();
+        for (int f = 0; f < frames; f++) {
+            trace_frame();
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << (specialize ? "Specialised: " : "Generic:     ")
+                  << elapsed.count() / frames << " ms/frame" << std::endl;
+    }
+
+    use_program(previous);
 }
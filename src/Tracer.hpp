@@ -17,6 +17,8 @@
 
 #include "cl.hpp"
 
+#include "FileWatcher.hpp"
+#include "ProgramBuilder.hpp"
 #include "Scene.hpp"
 #include "Renderer.hpp"
 
@@ -25,10 +27,18 @@ public:
     struct options {
         display_options dspo;
         bool shadows;
+        bool light_resampling;
+        bool occluder_cache;
+        int bounces;
+        bool specialize;
 
         bool operator!=(const options& o) {
             return dspo != o.dspo
-                || shadows != o.shadows;
+                || shadows != o.shadows
+                || light_resampling != o.light_resampling
+                || occluder_cache != o.occluder_cache
+                || bounces != o.bounces
+                || specialize != o.specialize;
         }
     };
 
@@ -38,6 +48,11 @@ public:
     void set_scene(const Scene& scene);
     void set_options(options& options);
     void reload_kernels();
+    void set_ray_budget(cl_uint budget);
+    const RayStats& stats() const { return ray_stats; }
+    void benchmark_textures();
+    void benchmark_specialization();
+    std::string build_log() { return builder.error_log(build_options(requested_options)); }
     void render();
 
 private:
@@ -46,16 +61,20 @@ private:
     cl::CommandQueue queue;
 
     const Scene* current_scene;
+    cl_uint bound_layout;
 
     int group_size;
 
     const std::string kernels_dir = "../src/kernels/";
-    const std::array<std::string, 6> kernel_filenames = { { "tracer.cl",
+    const std::array<std::string, 9> kernel_filenames = { { "tracer.cl",
                                                             "primitives.cl",
                                                             "intersect.cl",
                                                             "brdf.cl",
                                                             "shader.cl",
-                                                            "quaternion.cl" } };
+                                                            "quaternion.cl",
+                                                            "sampling.cl",
+                                                            "texture.cl",
+                                                            "benchmark.cl" } };
 
     cl::Program program;
     cl::Kernel tracer_krnl;
@@ -64,9 +83,26 @@ private:
     int width;
     int height;
 
+    std::array<cl::Buffer, 2> reservoir_buffers;
+    cl::Buffer occluder_cache;
+    cl::Buffer stats_buffer;
+    RayStats ray_stats;
+    cl_uint ray_budget;
+    cl_uint frame;
+
     options current_options;
+    ProgramBuilder builder;
+    options requested_options;
+    bool pending_options;
+    FileWatcher kernel_watcher;
 
+    std::string build_options(const options& options) const;
+    void use_program(cl::Program ready);
+    void request_variants();
+    void swap_ready_program();
+    void trace_frame();
     void set_tracer_kernel_args();
+    void init_frame_buffers();
 };
 
 void CL_CALLBACK contextCallback(const char*, const void*, size_t, void*);
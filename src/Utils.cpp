@@ -1,6 +1,8 @@
 #include "Utils.hpp"
 #include <boost/iostreams/device/mapped_file.hpp>
 
+bool verbose = false;
+
 std::string file_to_str (std::string filename)
 {
     using namespace boost::iostreams;
@@ -10,3 +12,14 @@ std::string file_to_str (std::string filename)
     return src;
 }
 
+uint64_t fnv1a(const void* data, size_t size, uint64_t basis)
+{
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = basis;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
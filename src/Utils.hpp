@@ -1,5 +1,14 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 std::string file_to_str (std::string filename);
+
+// 64 bit FNV-1a, stable across runs and platforms unlike std::hash. Pass
+// the previous result as basis to hash several buffers as one.
+uint64_t fnv1a(const void* data, size_t size, uint64_t basis = 14695981039346656037ull);
+
+// Print scene loading diagnostics, set by 'verbose' in config.yaml.
+extern bool verbose;
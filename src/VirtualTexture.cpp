@@ -0,0 +1,323 @@
+#include "VirtualTexture.hpp"
+#include "Utils.hpp"
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+static const char tile_magic[8] = {'T', 'R', 'A', 'C', 'E', 'T', 'I', 'L'};
+
+// A tile file is this header, one placement per material and then the
+// tiles. source_key identifies the texture files the atlas was packed
+// from, see source_key().
+struct TileFileHeader {
+    char magic[8];
+    uint64_t source_key;
+    uint32_t page_size;
+    uint32_t pages;
+    uint32_t tile_size;
+    uint32_t tile_border;
+    uint32_t materials;
+    uint32_t reserved;
+};
+
+struct TilePlacement {
+    uint32_t page;
+    uint32_t x;
+    uint32_t y;
+    uint32_t width;
+    uint32_t height;
+};
+
+static size_t bytes_per_tile()
+{
+    const size_t slot_size = VirtualTexture::tile_size + 2 * VirtualTexture::tile_border;
+    return slot_size * slot_size * 4;
+}
+
+static size_t tile_count(const TileFileHeader& header)
+{
+    const size_t tiles_per_row = header.page_size / header.tile_size;
+    return header.pages * tiles_per_row * tiles_per_row;
+}
+
+static size_t tiles_start(const TileFileHeader& header)
+{
+    return sizeof(TileFileHeader) + sizeof(TilePlacement) * header.materials;
+}
+
+// A header that matches the current tile layout and whose file holds all
+// the tiles it announces.
+static bool valid_header(const TileFileHeader& header, size_t file_size)
+{
+    return std::memcmp(header.magic, tile_magic, sizeof(tile_magic)) == 0
+        && header.tile_size == VirtualTexture::tile_size
+        && header.tile_border == VirtualTexture::tile_border
+        && header.page_size > 0 && header.page_size % header.tile_size == 0
+        && file_size == tiles_start(header) + tile_count(header) * bytes_per_tile();
+}
+
+VirtualTexture::VirtualTexture(cl::Context context, cl::CommandQueue queue,
+                               const std::vector<Material>& materials,
+                               const std::string& tile_filename, unsigned int cache_slots)
+    : context(context)
+    , queue(queue)
+    , tick(0)
+{
+    tile_file.open(tile_filename);
+    TileFileHeader header = {};
+    if (tile_file.size() >= sizeof(header)) {
+        std::memcpy(&header, tile_file.data(), sizeof(header));
+    }
+    if (!valid_header(header, tile_file.size()) || header.materials != materials.size()) {
+        throw std::runtime_error(tile_filename + " is not a tile file for this scene");
+    }
+    const unsigned int tiles_per_row = header.page_size / tile_size;
+    tiles = tile_count(header);
+    tiles_offset = tiles_start(header);
+    const unsigned int slot_size = tile_size + 2 * tile_border;
+
+    page_table.assign(tiles, -1);
+    requests.assign(tiles, 0);
+    slot_tiles.assign(cache_slots, -1);
+    slot_last_used.assign(cache_slots, 0);
+    slot_pinned.assign(cache_slots, false);
+
+    const unsigned int layers = (cache_slots + slots_per_row * slots_per_row - 1)
+                              / (slots_per_row * slots_per_row);
+    cache = cl::Image2DArray(context, CL_MEM_READ_ONLY,
+                             cl::ImageFormat(CL_RGBA, CL_UNORM_INT8), layers,
+                             slots_per_row * slot_size, slots_per_row * slot_size,
+                             0, 0, nullptr);
+
+    // The coarsest level of every material stays resident, so sampling can
+    // always fall back to something while finer tiles are loading.
+    cl_int slot = 0;
+    for (auto & material : materials) {
+        unsigned int width = material.uv_scale.s[0];
+        unsigned int height = material.uv_scale.s[1];
+        unsigned int level = mip_levels(width, height) - 1;
+        unsigned int x = material.uv_offset.s[0];
+        unsigned int y = material.uv_offset.s[1];
+        if (level > 0) {
+            x += width;
+            y += height - (height >> (level - 1));
+        }
+        cl_int tile = (material.diffuse * tiles_per_row + y / tile_size) * tiles_per_row
+                    + x / tile_size;
+        if (page_table[tile] >= 0) {
+            continue;
+        }
+        if (slot == (cl_int)cache_slots) {
+            throw std::runtime_error("texture cache too small for the pinned tiles");
+        }
+        upload(tile, slot);
+        slot_pinned[slot++] = true;
+    }
+
+    page_table_buffer = cl::Buffer(context, page_table.begin(), page_table.end(), false);
+    requests_buffer = cl::Buffer(context, requests.begin(), requests.end(), false);
+
+    if (verbose) {
+        std::cout << "Virtual texture: " << tiles << " tiles, "
+                  << cache_slots << " cache slots, "
+                  << slot << " pinned" << std::endl;
+    }
+}
+
+uint64_t VirtualTexture::source_key(const std::vector<std::string>& files,
+                                    unsigned int page_size)
+{
+    uint64_t key = fnv1a(&page_size, sizeof(page_size));
+    for (auto & file : files) {
+        struct stat info = {};
+        stat(file.c_str(), &info);
+        uint64_t size = info.st_size;
+        uint64_t modified = info.st_mtime;
+        key = fnv1a(file.c_str(), file.size() + 1, key);
+        key = fnv1a(&size, sizeof(size), key);
+        key = fnv1a(&modified, sizeof(modified), key);
+    }
+    return key;
+}
+
+bool VirtualTexture::read_layout(const std::string& tile_filename, uint64_t key,
+                                 Atlas& atlas, std::vector<Material>& materials)
+{
+    std::ifstream in(tile_filename, std::ios::binary | std::ios::ate);
+    if (!in) {
+        return false;
+    }
+    const size_t file_size = in.tellg();
+    TileFileHeader header = {};
+    std::vector<TilePlacement> placements(materials.size());
+    in.seekg(0).read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!in || header.source_key != key || header.materials != materials.size()
+     || !valid_header(header, file_size)) {
+        return false;
+    }
+    in.read(reinterpret_cast<char*>(placements.data()),
+            sizeof(TilePlacement) * placements.size());
+    if (!in) {
+        return false;
+    }
+
+    atlas.page_size = header.page_size;
+    atlas.pages = header.pages;
+    atlas.regions.clear();
+    atlas.pixels.clear();
+    for (size_t i = 0; i < materials.size(); i++) {
+        const TilePlacement & placement = placements[i];
+        if (placement.page >= header.pages) {
+            return false;
+        }
+        atlas.regions.push_back({ placement.page, placement.x, placement.y });
+        materials[i].diffuse = placement.page;
+        materials[i].uv_offset = {{ (cl_float)placement.x, (cl_float)placement.y }};
+        materials[i].uv_scale = {{ (cl_float)placement.width, (cl_float)placement.height }};
+    }
+    return true;
+}
+
+// Tiles are stored page by page, row by row, each with a border copied
+// from its neighbours so the cache can be filtered bilinearly per tile.
+void VirtualTexture::write_tiles(const std::string& tile_filename, uint64_t key,
+                                 const Atlas& atlas, const std::vector<Material>& materials)
+{
+    if (atlas.page_size % tile_size) {
+        throw std::runtime_error("atlas page size is not a multiple of the tile size");
+    }
+    const unsigned int tiles_per_row = atlas.page_size / tile_size;
+    const int slot_size = tile_size + 2 * tile_border;
+    const size_t page_bytes = size_t(atlas.page_size) * atlas.page_size * 4;
+
+    TileFileHeader header = {};
+    std::memcpy(header.magic, tile_magic, sizeof(tile_magic));
+    header.source_key = key;
+    header.page_size = atlas.page_size;
+    header.pages = atlas.pages;
+    header.tile_size = tile_size;
+    header.tile_border = tile_border;
+    header.materials = materials.size();
+
+    std::ofstream out(tile_filename, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    for (auto & material : materials) {
+        TilePlacement placement = {
+            (uint32_t)material.diffuse,
+            (uint32_t)material.uv_offset.s[0],
+            (uint32_t)material.uv_offset.s[1],
+            (uint32_t)material.uv_scale.s[0],
+            (uint32_t)material.uv_scale.s[1]
+        };
+        out.write(reinterpret_cast<const char*>(&placement), sizeof(placement));
+    }
+    std::vector<unsigned char> tile(slot_size * slot_size * 4);
+    for (unsigned int page = 0; page < atlas.pages; page++) {
+        const unsigned char* pixels = &atlas.pixels[page * page_bytes];
+        for (unsigned int ty = 0; ty < tiles_per_row; ty++) {
+            for (unsigned int tx = 0; tx < tiles_per_row; tx++) {
+                for (int y = 0; y < slot_size; y++) {
+                    int py = std::min(std::max<int>(ty * tile_size + y - tile_border, 0),
+                                      (int)atlas.page_size - 1);
+                    for (int x = 0; x < slot_size; x++) {
+                        int px = std::min(std::max<int>(tx * tile_size + x - tile_border, 0),
+                                          (int)atlas.page_size - 1);
+                        std::copy_n(&pixels[(py * atlas.page_size + px) * 4], 4,
+                                    &tile[(y * slot_size + x) * 4]);
+                    }
+                }
+                out.write(reinterpret_cast<const char*>(tile.data()), tile.size());
+            }
+        }
+    }
+    if (!out) {
+        throw std::runtime_error("could not write " + tile_filename);
+    }
+}
+
+// Reads back the tiles the last frame touched, refreshes the resident ones
+// and streams in up to max_uploads of the missing ones.
+void VirtualTexture::update()
+{
+    queue.enqueueReadBuffer(requests_buffer, CL_TRUE, 0,
+                            sizeof(cl_uint) * requests.size(), requests.data());
+    tick++;
+
+    std::vector<cl_int> missing;
+    for (cl_int tile = 0; tile < (cl_int)tiles; tile++) {
+        if (!requests[tile]) {
+            continue;
+        }
+        if (page_table[tile] >= 0) {
+            slot_last_used[page_table[tile]] = tick;
+        } else {
+            missing.push_back(tile);
+        }
+    }
+
+    if (missing.size() > max_uploads) {
+        missing.resize(max_uploads);
+    }
+    bool changed = false;
+    for (auto tile : missing) {
+        int slot = evict();
+        if (slot < 0) {
+            break;
+        }
+        upload(tile, slot);
+        slot_last_used[slot] = tick;
+        changed = true;
+    }
+
+    if (changed) {
+        queue.enqueueWriteBuffer(page_table_buffer, CL_FALSE, 0,
+                                 sizeof(cl_int) * page_table.size(), page_table.data());
+    }
+    queue.enqueueFillBuffer(requests_buffer, (cl_uint)0, 0,
+                            sizeof(cl_uint) * requests.size());
+}
+
+// Least recently used unpinned slot, or -1 if all were used this frame.
+int VirtualTexture::evict()
+{
+    int victim = -1;
+    for (int slot = 0; slot < (int)slot_tiles.size(); slot++) {
+        if (slot_pinned[slot] || slot_last_used[slot] == tick) {
+            continue;
+        }
+        if (victim < 0 || slot_last_used[slot] < slot_last_used[victim]) {
+            victim = slot;
+        }
+    }
+    if (victim >= 0 && slot_tiles[victim] >= 0) {
+        page_table[slot_tiles[victim]] = -1;
+    }
+    return victim;
+}
+
+void VirtualTexture::upload(cl_int tile, cl_int slot)
+{
+    const size_t slot_size = tile_size + 2 * tile_border;
+    const size_t tile_bytes = slot_size * slot_size * 4;
+    const unsigned int layer_slots = slots_per_row * slots_per_row;
+
+    cl::size_t<3> origin;
+    origin[0] = (slot % slots_per_row) * slot_size;
+    origin[1] = (slot % layer_slots / slots_per_row) * slot_size;
+    origin[2] = slot / layer_slots;
+    cl::size_t<3> region;
+    region[0] = slot_size;
+    region[1] = slot_size;
+    region[2] = 1;
+    queue.enqueueWriteImage(cache, CL_FALSE, origin, region, 0, 0,
+                            const_cast<char*>(tile_file.data() + tiles_offset
+                                              + tile * tile_bytes));
+
+    slot_tiles[slot] = tile;
+    page_table[tile] = slot;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#ifdef __APPLE__
+#include <OpenCL/cl.h>
+#include <OpenCL/cl_platform.h>
+#elif defined __linux__
+#include <CL/cl.h>
+#include <CL/cl_platform.h>
+#endif
+
+#include "cl.hpp"
+
+#include <boost/iostreams/device/mapped_file.hpp>
+#include <string>
+#include <vector>
+
+#include "Primitives.hpp"
+#include "Textures.hpp"
+
+// Atlas pages split into fixed size tiles that are streamed on demand from
+// a memory mapped tile file into a cache of physical slots. The kernel
+// looks tiles up in the page table and flags the ones it touched in the
+// request buffer; update() turns those flags into uploads, evicting the
+// least recently used slots.
+//
+// The tile file also stores the atlas layout and is keyed on the texture
+// files it was cut from, so while they are unchanged a scene loads its
+// materials from it without decoding a single texture.
+class VirtualTexture {
+public:
+    static const unsigned int tile_size = 128;
+    static const unsigned int tile_border = 1;
+    static const unsigned int slots_per_row = 8;
+    static const unsigned int max_uploads = 32;
+
+    VirtualTexture(cl::Context context, cl::CommandQueue queue,
+                   const std::vector<Material>& materials,
+                   const std::string& tile_filename, unsigned int cache_slots);
+    void update();
+
+    // Digest of the texture files' names, sizes and modification times
+    // and of the atlas page size.
+    static uint64_t source_key(const std::vector<std::string>& files, unsigned int page_size);
+    // Fills the atlas layout and the materials' atlas placement from a
+    // tile file written for key, or returns false if there is none.
+    static bool read_layout(const std::string& tile_filename, uint64_t key,
+                            Atlas& atlas, std::vector<Material>& materials);
+    static void write_tiles(const std::string& tile_filename, uint64_t key,
+                            const Atlas& atlas, const std::vector<Material>& materials);
+
+    cl::Image2DArray cache;
+    cl::Buffer page_table_buffer;
+    cl::Buffer requests_buffer;
+
+private:
+    cl::Context context;
+    cl::CommandQueue queue;
+
+    boost::iostreams::mapped_file_source tile_file;
+    size_t tiles_offset;
+    unsigned int tiles;
+    std::vector<cl_int> page_table;
+    std::vector<cl_uint> requests;
+    std::vector<cl_int> slot_tiles;
+    std::vector<unsigned long> slot_last_used;
+    std::vector<bool> slot_pinned;
+    unsigned long tick;
+
+    int evict();
+    void upload(cl_int tile, cl_int slot);
+};
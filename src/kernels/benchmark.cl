@@ -0,0 +1,46 @@
+#include "texture.h"
+#include "sampling.h"
+
+// Texture sampling throughput. Every work item walks a small neighbourhood
+// of its own texel in every material, so neighbouring items share cache
+// lines the way coherent primary rays do.
+float2 benchmarkTexcoord(uint* rng)
+{
+    float2 uv = (float2)(get_global_id(0), get_global_id(1))
+              / (float2)(get_global_size(0), get_global_size(1));
+    return uv + ((float2)(randomFloat(rng), randomFloat(rng)) - 0.5f) * 0.01f;
+}
+
+void kernel benchmark_image(read_only image2d_array_t image,
+                            global const struct Material* materials,
+                            int numMaterials,
+                            int samples,
+                            global float4* result)
+{
+    uint rng = hashSeed((int2)(get_global_id(0), get_global_id(1)), 0);
+    float4 sum = (float4)(0.0f);
+    for (int s = 0; s < samples; s++) {
+        struct Material m = materials[s % numMaterials];
+        sum += sampleMipImage(image, m.diffuse, m.uv_offset,
+                              convert_int2(m.uv_scale), 0, benchmarkTexcoord(&rng));
+    }
+    result[get_global_id(1) * get_global_size(0) + get_global_id(0)] = sum;
+}
+
+void kernel benchmark_blocks(global const uint2* blocks,
+                             int pageSize,
+                             global const struct Material* materials,
+                             int numMaterials,
+                             int samples,
+                             global float4* result)
+{
+    const struct Textures textures = { blocks, pageSize, 0, 0 };
+    uint rng = hashSeed((int2)(get_global_id(0), get_global_id(1)), 0);
+    float4 sum = (float4)(0.0f);
+    for (int s = 0; s < samples; s++) {
+        struct Material m = materials[s % numMaterials];
+        sum += sampleMipBlocks(&textures, m.diffuse, m.uv_offset,
+                               convert_int2(m.uv_scale), 0, benchmarkTexcoord(&rng));
+    }
+    result[get_global_id(1) * get_global_size(0) + get_global_id(0)] = sum;
+}
@@ -28,6 +28,53 @@ float3 intersectTriangle(struct Ray ray, struct Triangle triangle)
     }
 }
 
+// Moller-Trumbore on a mesh space ray. The determinant scales with the
+// mesh, so only an exactly parallel ray is rejected up front.
+float3 intersectPrecomputed(struct Ray ray, struct PrecomputedTriangle triangle)
+{
+    float3 P = cross(ray.direction, triangle.e2);
+    float det = dot(triangle.e1, P);
+    if (det == 0.0f) return (float3)(INFINITY, INFINITY, INFINITY);
+
+    float inv_det = 1.0f / det;
+    float3 T = ray.origin - triangle.v0;
+    float u = dot(T, P) * inv_det;
+    if (u < 0.0f || u > 1.0f) return (float3)(INFINITY, INFINITY, INFINITY);
+
+    float3 Q = cross(T, triangle.e1);
+    float v = dot(ray.direction, Q) * inv_det;
+    if (v < 0.0f || u + v > 1.0f) return (float3)(INFINITY, INFINITY, INFINITY);
+
+    float t = dot(triangle.e2, Q) * inv_det;
+    if (t > FLT_EPSILON) {
+        return (float3)(u, v, t);
+    } else {
+        return (float3)(INFINITY, INFINITY, INFINITY);
+    }
+}
+
+// PRECOMPUTED_TRIANGLES tests objectRay against the derived triangle
+// buffer, otherwise the triangle is assembled from the index and vertex
+// buffers and tested in world space.
+float3 intersectMeshTriangle(struct Ray ray,
+                             struct Ray objectRay,
+                             const struct Geometry* geometry,
+                             int numTriangle,
+                             struct Mesh mesh)
+{
+#ifdef PRECOMPUTED_TRIANGLES
+    return intersectPrecomputed(objectRay,
+                                geometry->triangles[(mesh.base_triangle + numTriangle) / 3]);
+#else
+    return intersectTriangle(ray, constructTriangle(geometry->vertices,
+                                                    geometry->vertexAttributes,
+                                                    geometry->indices,
+                                                    numTriangle, mesh));
+#endif
+}
+
+// Distance at which the ray enters the box, clamped to the origin, or
+// INFINITY if it misses.
 float intersectAABB(struct Ray ray, struct AABB aabb)
 {
     float tx1 = (aabb.min.x - ray.origin.x) * ray.direction_inverse.x;
@@ -48,6 +95,7 @@ float intersectAABB(struct Ray ray, struct AABB aabb)
     tmin = max(tmin, min(tz1, tz2));
     tmax = min(tmax, max(tz1, tz2));
 
-    return tmax >= tmin;
+    tmin = max(tmin, 0.0f);
+    return tmax >= tmin ? tmin : (float)(INFINITY);
 }
 
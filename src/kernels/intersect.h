@@ -1,7 +1,15 @@
 #ifndef INTERSECT_H_
 #define INTERSECT_H_
 
+#include "primitives.h"
+
 float3 intersectTriangle(struct Ray ray, struct Triangle triangle);
+float3 intersectPrecomputed(struct Ray ray, struct PrecomputedTriangle triangle);
+float3 intersectMeshTriangle(struct Ray ray,
+                             struct Ray objectRay,
+                             const struct Geometry* geometry,
+                             int numTriangle,
+                             struct Mesh mesh);
 float intersectAABB(struct Ray ray, struct AABB aabb);
 
 #endif
@@ -11,4 +11,10 @@
 #define DISPLAY SHADED
 #endif
 
+#ifndef MAX_BOUNCES
+#define MAX_BOUNCES 0
+#endif
+
+#define ROULETTE_MIN_BOUNCES 1
+
 #endif
@@ -12,11 +12,11 @@ struct Triangle constructTriangle(global const struct Vertex* vertices,
                       indices[offset + 2]);
 
     struct Triangle triangle;
-    triangle.a.position = rotate_quat(mesh.orientation, vertices[i.x + mesh.base_vertex].position) 
+    triangle.a.position = rotate_quat(mesh.orientation, vertexPosition(vertices, i.x, mesh)) 
                         *  mesh.scale + mesh.position;
-    triangle.b.position = rotate_quat(mesh.orientation, vertices[i.y + mesh.base_vertex].position) 
+    triangle.b.position = rotate_quat(mesh.orientation, vertexPosition(vertices, i.y, mesh)) 
                         *  mesh.scale + mesh.position;
-    triangle.c.position = rotate_quat(mesh.orientation, vertices[i.z + mesh.base_vertex].position) 
+    triangle.c.position = rotate_quat(mesh.orientation, vertexPosition(vertices, i.z, mesh)) 
                         *  mesh.scale + mesh.position;
 
     triangle.aa = &vertexAttributes[i.x + mesh.base_vertex];
@@ -26,6 +26,48 @@ struct Triangle constructTriangle(global const struct Vertex* vertices,
     return triangle;
 }
 
+struct Mesh assembleMesh(struct Instance i, struct MeshGeometry g)
+{
+    struct Mesh mesh;
+    mesh.orientation = i.orientation;
+    mesh.position = i.position;
+    mesh.scale = (float3)(i.scale);
+    mesh.num_triangles = g.num_triangles;
+    mesh.material = i.material;
+    mesh.base_vertex = g.base_vertex;
+    mesh.base_triangle = g.base_triangle;
+    mesh.revision = i.revision;
+    mesh.bounds = g.bounds;
+    return mesh;
+}
+
+struct Mesh loadMesh(const struct Geometry* geometry, int instance)
+{
+    struct Instance i = geometry->instances[instance];
+    return assembleMesh(i, geometry->geometries[i.geometry]);
+}
+
+// Shadow rays see the coarser level of every instance except the receiver,
+// whose own surface the ray starts on.
+struct Mesh loadShadowMesh(const struct Geometry* geometry, int instance, int receiver)
+{
+    struct Instance i = geometry->instances[instance];
+    struct MeshGeometry g = geometry->geometries[i.geometry];
+    if (instance != receiver) {
+        g = geometry->geometries[g.shadow];
+    }
+    return assembleMesh(i, g);
+}
+
+float3 vertexPosition(global const struct Vertex* vertices, int index, struct Mesh mesh)
+{
+#ifdef QUANTIZED_POSITIONS
+    float3 q = convert_float3(vertices[index + mesh.base_vertex].position.xyz) / 65535.0f;
+    return mesh.bounds.min + q * (mesh.bounds.max - mesh.bounds.min);
+#else
+    return vertices[index + mesh.base_vertex].position;
+#endif
+}
 
 struct Ray createRay(float3 origin, float3 direction)
 {
@@ -33,5 +75,43 @@ struct Ray createRay(float3 origin, float3 direction)
     ray.direction = direction;
     ray.origin = origin;
     ray.direction_inverse = 1.0f / direction;
+    ray.width = 0.0f;
+    ray.spread = 0.0f;
     return ray;
 }
+
+// Inverse of the mesh transform applied in constructTriangle. The
+// direction is not renormalised, so distances along it match the world
+// space ray.
+struct Ray objectSpaceRay(struct Ray ray, struct Mesh mesh)
+{
+    quaternion inverse = (quaternion)(-mesh.orientation.xyz, mesh.orientation.w);
+    return createRay(rotate_quat(inverse, (ray.origin - mesh.position) / mesh.scale),
+                     rotate_quat(inverse, ray.direction / mesh.scale));
+}
+
+// Inverse of VertexAttributes::encode_normal on the host.
+float3 decodeNormal(global const struct VertexAttributes* attributes)
+{
+    float2 e = fmax(convert_float2(as_short2(attributes->normal)) / 32767.0f, -1.0f);
+    float3 n = (float3)(e, 1.0f - fabs(e.x) - fabs(e.y));
+    if (n.z < 0.0f) {
+        n.xy = (1.0f - fabs(n.yx)) * copysign((float2)(1.0f, 1.0f), n.xy);
+    }
+    return normalize(n);
+}
+
+// Same mapping as VertexAttributes::encode_normal on the host.
+uint encodeNormal(float3 n)
+{
+    float2 e = n.xy / (fabs(n.x) + fabs(n.y) + fabs(n.z));
+    if (n.z < 0.0f) {
+        e = (1.0f - fabs(e.yx)) * copysign((float2)(1.0f, 1.0f), e);
+    }
+    return as_uint(convert_short2_rte(clamp(e, -1.0f, 1.0f) * 32767.0f));
+}
+
+float2 decodeTexcoord(global const struct VertexAttributes* attributes)
+{
+    return vload_half2(0, (global const half*)&attributes->texcoord);
+}
@@ -9,6 +9,8 @@ struct Ray {
     float3 origin;
     float3 direction;
     float3 direction_inverse;
+    float width;
+    float spread;
 };
 
 struct RayHit {
@@ -16,8 +18,10 @@ struct RayHit {
     float3 normal;
     float2 texcoord;
     float dist;
+    float coneWidth;
+    float lodBias;
     int material;
-    global const struct Mesh* mesh;
+    int instance;
     global const Indice* indice;
 };
 
@@ -31,6 +35,8 @@ struct Material {
     int diffuse;
     float fresnel0;
     float roughness;
+    float2 uv_offset;
+    float2 uv_scale;
 };
 
 struct Plane {
@@ -46,6 +52,20 @@ struct Sphere {
 };
 
 
+struct AABB {
+    float3 min;
+    float3 max;
+};
+
+// First vertex and both edges of a triangle in mesh space, one record per
+// triangle in index buffer order.
+struct PrecomputedTriangle {
+    float3 v0;
+    float3 e1;
+    float3 e2;
+};
+
+// Instance and geometry combined, assembled in private memory by loadMesh.
 struct Mesh {
     quaternion orientation;
     float3 position;
@@ -56,47 +76,91 @@ struct Mesh {
 
     int base_vertex;
     int base_triangle;
+
+    uint revision;
+    struct AABB bounds;
 };
 
+// QUANTIZED_POSITIONS stores positions as unorm16 relative to the mesh
+// bounds.
 struct Vertex {
+#ifdef QUANTIZED_POSITIONS
+    ushort4 position;
+#else
+    float3 position;
+#endif
+};
+
+struct WorldVertex {
     float3 position;
 };
 
 struct VertexAttributes {
-    float3 normal;
-    float2 texcoord;
+    uint normal;
+    uint texcoord;
 };
 
 
 struct Triangle {
-    struct Vertex a;
-    struct Vertex b;
-    struct Vertex c;
+    struct WorldVertex a;
+    struct WorldVertex b;
+    struct WorldVertex c;
     global const struct VertexAttributes* aa;
     global const struct VertexAttributes* ba;
     global const struct VertexAttributes* ca;
 };
 
-struct AABB {
-    float3 min;
-    float3 max;
+struct Instance {
+    quaternion orientation;
+    float3 position;
+    float scale;
+    int geometry;
+    int material;
+    uint revision;
+};
+
+// shadow is the geometry shadow rays test instead, a coarser level of
+// detail or the geometry itself.
+struct MeshGeometry {
+    int base_vertex;
+    int base_triangle;
+    int num_triangles;
+    int shadow;
+    struct AABB bounds;
 };
 
+// Top level BVH over instances. Interior nodes have count 0 and children
+// at first and first + 1, leaves cover count entries of bvhInstances.
 struct BVHNode {
     struct AABB bounds;
-    float3 position;
-    float3 scale;
-    int mesh;
+    int first;
+    int count;
+};
+
+// The host bounds the tree depth, see BVH.hpp.
+#define BVH_STACK_SIZE 64
+
+#define PATH_LENGTH_BINS 16
+
+struct RayStats {
+    uint rays;
+    uint roulette;
+    uint budget_exhausted;
+    uint misses;
+    uint path_lengths[PATH_LENGTH_BINS];
 };
 
 struct Geometry {
     global const struct Vertex* vertices;
     global const struct VertexAttributes* vertexAttributes;
     global const Indice* indices;
-    global const struct Mesh* meshes;
-    int numMeshes;
+    global const struct Instance* instances;
+    int numInstances;
+    global const struct MeshGeometry* geometries;
     global const struct BVHNode* bvh;
     int numBVHNodes;
+    global const int* bvhInstances;
+    global const struct PrecomputedTriangle* triangles;
 };
 
 struct Triangle constructTriangle(global const struct Vertex* vertices,
@@ -105,6 +169,14 @@ struct Triangle constructTriangle(global const struct Vertex* vertices,
                                   int numTriangle,
                                   struct Mesh);
 
+struct Mesh assembleMesh(struct Instance i, struct MeshGeometry g);
+struct Mesh loadMesh(const struct Geometry* geometry, int instance);
+struct Mesh loadShadowMesh(const struct Geometry* geometry, int instance, int receiver);
+float3 vertexPosition(global const struct Vertex* vertices, int index, struct Mesh mesh);
 struct Ray createRay(float3 origin, float3 direction);
+struct Ray objectSpaceRay(struct Ray ray, struct Mesh mesh);
+float3 decodeNormal(global const struct VertexAttributes* attributes);
+uint encodeNormal(float3 n);
+float2 decodeTexcoord(global const struct VertexAttributes* attributes);
 
 #endif
@@ -0,0 +1,68 @@
+#include "sampling.h"
+
+uint wangHash(uint seed)
+{
+    seed = (seed ^ 61u) ^ (seed >> 16);
+    seed *= 9u;
+    seed = seed ^ (seed >> 4);
+    seed *= 0x27d4eb2du;
+    seed = seed ^ (seed >> 15);
+    return seed;
+}
+
+uint hashSeed(int2 coord, uint frame)
+{
+    uint pixel = coord.y * get_global_size(0) + coord.x;
+    return max(wangHash(pixel ^ wangHash(frame)), 1u);
+}
+
+// xorshift32
+float randomFloat(uint* state)
+{
+    uint x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return (x >> 8) * (1.0f / 16777216.0f);
+}
+
+float3 randomDirection(uint* state)
+{
+    float z = randomFloat(state) * 2.0f - 1.0f;
+    float a = randomFloat(state) * 2.0f * M_PI_F;
+    float r = sqrt(1.0f - z * z);
+    return (float3)(r * cos(a), r * sin(a), z);
+}
+
+struct Reservoir emptyReservoir(float depth)
+{
+    struct Reservoir r;
+    r.light = -1;
+    r.weight_sum = 0.0f;
+    r.count = 0.0f;
+    r.weight = 0.0f;
+    r.depth = depth;
+    return r;
+}
+
+// Weighted reservoir sampling, returns true when the candidate replaces
+// the currently selected light.
+bool updateReservoir(struct Reservoir* r, int light,
+                     float weight, float count, uint* rng)
+{
+    r->weight_sum += weight;
+    r->count += count;
+    if (weight > 0.0f && randomFloat(rng) * r->weight_sum < weight) {
+        r->light = light;
+        return true;
+    }
+    return false;
+}
+
+bool similarReservoir(struct Reservoir r, float depth, int numLights)
+{
+    return r.light >= 0 && r.light < numLights
+        && r.count > 0.0f
+        && fabs(r.depth - depth) < 0.1f * depth;
+}
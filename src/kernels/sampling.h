@@ -0,0 +1,39 @@
+#ifndef SAMPLING_H_
+#define SAMPLING_H_
+
+#include "primitives.h"
+
+#ifndef LIGHT_CANDIDATES
+#define LIGHT_CANDIDATES 8
+#endif
+
+#define RESERVOIR_HISTORY 20.0f
+#define SPATIAL_NEIGHBOURS 4
+#define SPATIAL_RADIUS 16.0f
+
+struct Reservoir {
+    int light;
+    float weight_sum;
+    float count;
+    float weight;
+    float depth;
+};
+
+struct ReservoirBuffers {
+    global struct Reservoir* current;
+    global const struct Reservoir* previous;
+    int2 coord;
+    uint frame;
+};
+
+uint wangHash(uint seed);
+uint hashSeed(int2 coord, uint frame);
+float randomFloat(uint* state);
+float3 randomDirection(uint* state);
+
+struct Reservoir emptyReservoir(float depth);
+bool updateReservoir(struct Reservoir* r, int light,
+                     float weight, float count, uint* rng);
+bool similarReservoir(struct Reservoir r, float depth, int numLights);
+
+#endif
@@ -3,6 +3,8 @@
 #include "brdf.h"
 #include "intersect.h"
 #include "options.h"
+#include "sampling.h"
+#include "texture.h"
 
 float3 shade(float3 normal, float3 view,
              float3 lightDir, float3 halfVec,
@@ -26,9 +28,26 @@ float3 shade(float3 normal, float3 view,
     return clamp(color_add, 0.0f, 1.0f);
 }
 
-__constant sampler_t sampler = CLK_FILTER_LINEAR 
-                             | CLK_NORMALIZED_COORDS_TRUE
-                             | CLK_ADDRESS_CLAMP_TO_EDGE;
+float3 lightContribution(struct RayHit hit,
+                         float3 view,
+                         float3 diffuse,
+                         struct Material material,
+                         struct Light light)
+{
+    float3 lightDir = normalize(light.location - hit.location);
+    float3 halfVec = normalize(lightDir + view);
+    float lightDist = distance(hit.location, light.location);
+    float att = clamp(1.0f - lightDist * lightDist
+                      / (light.radius * light.radius), 0.0f, 1.0f);
+    att *= att;
+    return att * shade(hit.normal, view, lightDir, halfVec,
+                       light.color, diffuse, material.roughness, material.fresnel0);
+}
+
+float luminance(float3 color)
+{
+    return dot(color, (float3)(0.2126f, 0.7152f, 0.0722f));
+}
 
 float3 gatherLight(struct Ray ray,
                    struct RayHit hit,
@@ -36,21 +55,17 @@ float3 gatherLight(struct Ray ray,
                    global const struct Light* lights,
                    int numLights,
                    global const struct Material* materials,
-                   read_only image2d_array_t diffuse_textures)
+                   read_only image2d_array_t diffuse_textures,
+                   const struct Textures* textures,
+                   struct OccluderCache* occluders)
 {
     struct Material material = materials[hit.material];
-    uint4 diffuse = read_imageui(diffuse_textures, sampler, 
-                                 (float4)(hit.texcoord.x, 
-                                          hit.texcoord.y, 
-                                          convert_float(material.diffuse), 0.0f));
+    float3 diffuse = sampleDiffuse(ray, hit, material, diffuse_textures, textures);
 #if DISPLAY==UNLIT
-    return convert_float3(diffuse.xyz) / 255.0f;
+    return diffuse;
 #else
-    float3 view = -normalize(hit.location);
-    float3 normal = hit.normal;
-    float3 color = (convert_float3(diffuse.xyz) / 255.0f) * 0.4f;
-    float roughness = material.roughness;
-    float fresnel0 = material.fresnel0;
+    float3 view = -ray.direction;
+    float3 color = diffuse * 0.4f;
     
     for (int l = 0; l < numLights; l++) {
         struct Light light = lights[l];
@@ -59,15 +74,11 @@ float3 gatherLight(struct Ray ray,
                                           lightDir);
         if (!occluded(rayToLight,
                             distance(hit.location,light.location),
-                            hit.indice,
-                            geometry)) {
-            float3 halfVec = normalize(lightDir + view);
-            float lightDist = distance(hit.location, light.location);
-            float att = clamp(1.0f - lightDist * lightDist
-                              / (light.radius * light.radius), 0.0f, 1.0f);
-            att *= att;
-            color += att * shade(normal, view, lightDir, halfVec,
-                                 light.color, convert_float3(diffuse.xyz) / 255.0f, roughness, fresnel0);
+                            hit,
+                            geometry,
+                            l,
+                            occluders)) {
+            color += lightContribution(hit, view, diffuse, material, light);
         }
     }
     
@@ -75,38 +86,190 @@ float3 gatherLight(struct Ray ray,
 #endif
 }
 
+// Resampled importance sampling of a single light per pixel. Candidates
+// are weighted by their unshadowed contribution, merged with the previous
+// frame's reservoirs of this pixel and some of its neighbours, and only the
+// surviving light is tested for visibility.
+float3 gatherLightResampled(struct Ray ray,
+                            struct RayHit hit,
+                            const struct Geometry* geometry,
+                            global const struct Light* lights,
+                            int numLights,
+                            global const struct Material* materials,
+                            read_only image2d_array_t diffuse_textures,
+                            const struct Textures* textures,
+                            const struct ReservoirBuffers* reservoirs,
+                            struct OccluderCache* occluders)
+{
+    struct Material material = materials[hit.material];
+    float3 diffuse = sampleDiffuse(ray, hit, material, diffuse_textures, textures);
+#if DISPLAY==UNLIT
+    return diffuse;
+#else
+    float3 view = -ray.direction;
+    float3 color = diffuse * 0.4f;
+
+    const int width = get_global_size(0);
+    const int height = get_global_size(1);
+    const int2 coord = reservoirs->coord;
+    uint rng = hashSeed(coord, reservoirs->frame);
+
+    struct Reservoir r = emptyReservoir(hit.dist);
+    float selectedPHat = 0.0f;
+
+    const int candidates = min(numLights, LIGHT_CANDIDATES);
+    for (int c = 0; c < candidates; c++) {
+        int l = min((int)(randomFloat(&rng) * numLights), numLights - 1);
+        float pHat = luminance(lightContribution(hit, view, diffuse,
+                                                 material, lights[l]));
+        if (updateReservoir(&r, l, pHat * numLights, 1.0f, &rng)) {
+            selectedPHat = pHat;
+        }
+    }
+
+    const float maxHistory = RESERVOIR_HISTORY * candidates;
+    for (int n = 0; n <= SPATIAL_NEIGHBOURS; n++) {
+        int2 neighbour = coord;
+        if (n > 0) {
+            float angle = randomFloat(&rng) * 2.0f * M_PI_F;
+            float radius = randomFloat(&rng) * SPATIAL_RADIUS;
+            neighbour += convert_int2((float2)(cos(angle), sin(angle)) * radius);
+            neighbour = clamp(neighbour, (int2)(0, 0), (int2)(width - 1, height - 1));
+        }
+        struct Reservoir q = reservoirs->previous[neighbour.y * width + neighbour.x];
+        if (!similarReservoir(q, hit.dist, numLights)) {
+            continue;
+        }
+        q.count = fmin(q.count, maxHistory);
+        float pHat = luminance(lightContribution(hit, view, diffuse,
+                                                 material, lights[q.light]));
+        if (updateReservoir(&r, q.light, pHat * q.weight * q.count, q.count, &rng)) {
+            selectedPHat = pHat;
+        }
+    }
+
+    if (r.light >= 0 && selectedPHat > 0.0f) {
+        r.weight = r.weight_sum / (r.count * selectedPHat);
+
+        struct Light light = lights[r.light];
+        struct Ray rayToLight = createRay(hit.location,
+                                          normalize(light.location - hit.location));
+        if (occluded(rayToLight,
+                     distance(hit.location, light.location),
+                     hit,
+                     geometry,
+                     r.light,
+                     occluders)) {
+            r.weight = 0.0f;
+        } else {
+            color += r.weight * lightContribution(hit, view, diffuse, material, light);
+        }
+    }
+
+    r.count = fmin(r.count, maxHistory);
+    reservoirs->current[coord.y * width + coord.x] = r;
+
+    return color;
+#endif
+}
+
 bool occluded(struct Ray ray,
               float targetDistance,
-              global const Indice* ignoredIndices,
-              const struct Geometry* geometry)
+              struct RayHit ignored,
+              const struct Geometry* geometry,
+              int light,
+              struct OccluderCache* occluders)
 {
 #ifndef NOSHADOWS
-    for (int b = 0; b < geometry->numBVHNodes; b++) {
-        struct BVHNode bvhnode = geometry->bvh[b];
-        bvhnode.bounds.min = bvhnode.bounds.min
-                           * bvhnode.scale
-                           + bvhnode.position;
-        bvhnode.bounds.max = bvhnode.bounds.max
-                           * bvhnode.scale
-                           + bvhnode.position;
-        if (intersectAABB(ray, bvhnode.bounds)) {
-     
-            struct Mesh mesh = geometry->meshes[b];
+#ifdef OCCLUDER_CACHE
+    if (cachedOccluder(ray, targetDistance, geometry, light, occluders)) {
+        return true;
+    }
+    global struct OccluderCacheEntry* entry = &occluders->entries[light];
+#endif
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (geometry->numBVHNodes > 0) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        struct BVHNode node = geometry->bvh[stack[--top]];
+        if (intersectAABB(ray, node.bounds) >= targetDistance) {
+            continue;
+        }
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            int instance = geometry->bvhInstances[i];
+            struct Mesh mesh = loadShadowMesh(geometry, instance, ignored.instance);
+            struct Ray objectRay = objectSpaceRay(ray, mesh);
             for (int p = 0; p < mesh.num_triangles; p += 3) {
-                if (&geometry->indices[p] == ignoredIndices)
+                if (&geometry->indices[mesh.base_triangle + p] == ignored.indice
+                 && instance == ignored.instance)
                     continue;
 
-                struct Triangle triangle = constructTriangle(geometry->vertices,
-                                                             geometry->vertexAttributes,
-                                                             geometry->indices,
-                                                             p, mesh);
-                float3 uvt = intersectTriangle(ray, triangle);
+                float3 uvt = intersectMeshTriangle(ray, objectRay, geometry, p, mesh);
                 if (uvt.z < targetDistance && uvt.z > 0.0f) {
+#ifdef OCCLUDER_CACHE
+                    if (occluders->receiver < 0) {
+                        return true;
+                    }
+                    struct OccluderCacheEntry occluder = {
+                        light,
+                        occluders->receiver,
+                        occluders->receiverMesh,
+                        mesh.base_triangle + p,
+                        instance,
+                        occluders->receiverRevision,
+                        mesh.revision
+                    };
+                    *entry = occluder;
+#endif
                     return true;
                 }
             }
         }
     }
+#ifdef OCCLUDER_CACHE
+    if (occluders->receiver >= 0) {
+        entry->light = -1;
+    }
+#endif
 #endif
     return false;
 }
+
+// Tests the triangle that occluded this pixel/light pair last time. Entries
+// are only trusted while neither the receiving nor the occluding instance
+// has moved since they were written. Secondary hits pass a negative receiver
+// and bypass the cache.
+bool cachedOccluder(struct Ray ray,
+                    float targetDistance,
+                    const struct Geometry* geometry,
+                    int light,
+                    const struct OccluderCache* occluders)
+{
+    if (occluders->receiver < 0) {
+        return false;
+    }
+
+    struct OccluderCacheEntry entry = occluders->entries[light];
+    if (entry.light != light
+     || entry.receiver != occluders->receiver
+     || entry.receiver_mesh != occluders->receiverMesh
+     || entry.receiver_revision != occluders->receiverRevision) {
+        return false;
+    }
+
+    struct Mesh mesh = loadShadowMesh(geometry, entry.occluder_mesh, occluders->receiverMesh);
+    if (entry.occluder_revision != mesh.revision) {
+        return false;
+    }
+
+    float3 uvt = intersectMeshTriangle(ray, objectSpaceRay(ray, mesh), geometry,
+                                       entry.occluder - mesh.base_triangle, mesh);
+    return uvt.z < targetDistance && uvt.z > 0.0f;
+}
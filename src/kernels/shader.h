@@ -2,20 +2,64 @@
 #define SHADER_H_
 
 #include "primitives.h"
+#include "sampling.h"
+#include "texture.h"
+
+struct OccluderCacheEntry {
+    int light;
+    int receiver;
+    int receiver_mesh;
+    int occluder;
+    int occluder_mesh;
+    uint receiver_revision;
+    uint occluder_revision;
+};
+
+struct OccluderCache {
+    global struct OccluderCacheEntry* entries;
+    int receiver;
+    int receiverMesh;
+    uint receiverRevision;
+};
 
 float3 shade(float3 normal, float3 view,
              float3 lightDir, float3 halfVec,
              float3 lightColor, float3 diffuse,
              float roughness, float fresnel0);
+float3 lightContribution(struct RayHit hit,
+                         float3 view,
+                         float3 diffuse,
+                         struct Material material,
+                         struct Light light);
+float luminance(float3 color);
 float3 gatherLight(struct Ray ray,
                    struct RayHit hit,
                    const struct Geometry* geometry,
                    global const struct Light* lights,
                    int numLights,
                    global const struct Material* materials,
-                   read_only image2d_array_t diffuse);
+                   read_only image2d_array_t diffuse,
+                   const struct Textures* textures,
+                   struct OccluderCache* occluders);
+float3 gatherLightResampled(struct Ray ray,
+                            struct RayHit hit,
+                            const struct Geometry* geometry,
+                            global const struct Light* lights,
+                            int numLights,
+                            global const struct Material* materials,
+                            read_only image2d_array_t diffuse_textures,
+                            const struct Textures* textures,
+                            const struct ReservoirBuffers* reservoirs,
+                            struct OccluderCache* occluders);
 bool occluded(struct Ray ray,
               float targetDistance,
-              global const Indice* ignoredIndices,
-              const struct Geometry* geometry);
+              struct RayHit ignored,
+              const struct Geometry* geometry,
+              int light,
+              struct OccluderCache* occluders);
+bool cachedOccluder(struct Ray ray,
+                    float targetDistance,
+                    const struct Geometry* geometry,
+                    int light,
+                    const struct OccluderCache* occluders);
 #endif
@@ -0,0 +1,58 @@
+#include "skinning.h"
+
+float3 transformJoint(struct JointTransform m, float4 v)
+{
+    return (float3)(dot(m.rows[0], v), dot(m.rows[1], v), dot(m.rows[2], v));
+}
+
+struct JointTransform blendJoints(global const struct JointTransform* joints,
+                                  ushort4 index, float4 weight)
+{
+    struct JointTransform a = joints[index.x];
+    struct JointTransform b = joints[index.y];
+    struct JointTransform c = joints[index.z];
+    struct JointTransform d = joints[index.w];
+    struct JointTransform m;
+    for (int r = 0; r < 3; r++) {
+        m.rows[r] = weight.x * a.rows[r] + weight.y * b.rows[r]
+                  + weight.z * c.rows[r] + weight.w * d.rows[r];
+    }
+    return m;
+}
+
+// Linear blend skinning, one work item per vertex of every skinned copy.
+// Vertices without weights keep their bind pose.
+void kernel skin(global const struct SkinVertex* skinVertices,
+                 global const struct JointTransform* joints,
+                 global struct Vertex* vertices,
+                 global struct VertexAttributes* vertexAttributes)
+{
+    struct SkinVertex v = skinVertices[get_global_id(0)];
+    float4 weight = convert_float4(v.weights);
+    float total = weight.x + weight.y + weight.z + weight.w;
+    float3 position = v.position;
+    float3 normal = v.normal;
+    if (total > 0.0f) {
+        struct JointTransform m = blendJoints(joints, v.joints, weight / total);
+        position = transformJoint(m, (float4)(position, 1.0f));
+        normal = normalize(transformJoint(m, (float4)(normal, 0.0f)));
+    }
+    vertices[v.target].position = position;
+    vertexAttributes[v.target].normal = encodeNormal(normal);
+}
+
+// Refreshes the precomputed triangles of the skinned copies once their
+// vertices are written. Every entry is a triangle and the base vertex of
+// the copy it belongs to.
+void kernel skinTriangles(global const int2* skinTriangles,
+                          global const struct Vertex* vertices,
+                          global const Indice* indices,
+                          global struct PrecomputedTriangle* triangles)
+{
+    int2 t = skinTriangles[get_global_id(0)];
+    float3 a = vertices[t.y + indices[t.x * 3]].position;
+    float3 b = vertices[t.y + indices[t.x * 3 + 1]].position;
+    float3 c = vertices[t.y + indices[t.x * 3 + 2]].position;
+    struct PrecomputedTriangle triangle = { a, b - a, c - a };
+    triangles[t.x] = triangle;
+}
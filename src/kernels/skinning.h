@@ -0,0 +1,23 @@
+#ifndef SKINNING_H_
+#define SKINNING_H_
+
+#include "primitives.h"
+
+// Bind pose of one vertex of a skinned copy, see SkinVertex on the host.
+struct SkinVertex {
+    float3 position;
+    float3 normal;
+    ushort4 joints;
+    uchar4 weights;
+    int target;
+};
+
+struct JointTransform {
+    float4 rows[3];
+};
+
+float3 transformJoint(struct JointTransform m, float4 v);
+struct JointTransform blendJoints(global const struct JointTransform* joints,
+                                  ushort4 index, float4 weight);
+
+#endif
@@ -0,0 +1,156 @@
+#include "texture.h"
+#include "options.h"
+
+__constant sampler_t mipSampler = CLK_FILTER_LINEAR
+                                | CLK_NORMALIZED_COORDS_FALSE
+                                | CLK_ADDRESS_CLAMP_TO_EDGE;
+
+// Ray cone footprint (Akenine-Moller et al.), size is level 0 in texels.
+float textureLod(struct Ray ray, struct RayHit hit, int2 size)
+{
+    float cosine = fmax(fabs(dot(hit.normal, ray.direction)), 1e-3f);
+    return hit.lodBias
+         + 0.5f * log2((float)(size.x * size.y))
+         + log2(hit.coneWidth / cosine);
+}
+
+// Levels are laid out as in mip_layout on the host: level 0 at offset,
+// level n > 0 in the column right of it at height
+// size.y - (size.y >> (n - 1)). Returns the page coordinate of uv,
+// clamped half a texel inside the level.
+float2 mipTexel(float2 offset, int2 size, int level, float2 uv)
+{
+    int2 levelSize = max(size >> level, 1);
+    float2 origin = level == 0
+                  ? offset
+                  : offset + convert_float2((int2)(size.x, size.y - (size.y >> (level - 1))));
+    return origin + clamp(uv * convert_float2(levelSize),
+                          0.5f, convert_float2(levelSize) - 0.5f);
+}
+
+float4 sampleMipImage(read_only image2d_array_t image,
+                      int page, float2 offset, int2 size, int level, float2 uv)
+{
+    float2 texel = mipTexel(offset, size, level, uv);
+    return read_imagef(image, mipSampler,
+                       (float4)(texel, convert_float(page), 0.0f));
+}
+
+float3 decode565(uint color)
+{
+    return convert_float3((uint3)((color >> 11) & 31,
+                                  (color >> 5) & 63,
+                                  color & 31)) / (float3)(31.0f, 63.0f, 31.0f);
+}
+
+// BC1 blocks are stored row by row, page after page.
+float4 fetchBlockTexel(global const uint2* blocks, int pageSize, int page, int2 texel)
+{
+    texel = clamp(texel, 0, pageSize - 1);
+    const int blocksPerRow = pageSize / 4;
+    uint2 block = blocks[(page * blocksPerRow + texel.y / 4) * blocksPerRow + texel.x / 4];
+
+    uint c0 = block.x & 0xffff;
+    uint c1 = block.x >> 16;
+    uint index = (block.y >> (((texel.y & 3) * 4 + (texel.x & 3)) * 2)) & 3;
+    float3 color0 = decode565(c0);
+    float3 color1 = decode565(c1);
+
+    float3 color;
+    if (index == 0) {
+        color = color0;
+    } else if (index == 1) {
+        color = color1;
+    } else if (c0 > c1) {
+        color = index == 2 ? mix(color0, color1, 1.0f / 3.0f)
+                           : mix(color0, color1, 2.0f / 3.0f);
+    } else {
+        color = index == 2 ? mix(color0, color1, 0.5f)
+                           : (float3)(0.0f, 0.0f, 0.0f);
+    }
+    return (float4)(color, 1.0f);
+}
+
+float4 sampleMipBlocks(const struct Textures* textures,
+                       int page, float2 offset, int2 size, int level, float2 uv)
+{
+    float2 texel = mipTexel(offset, size, level, uv) - 0.5f;
+    float2 base = floor(texel);
+    float2 f = texel - base;
+    int2 i = convert_int2(base);
+
+    float4 t00 = fetchBlockTexel(textures->blocks, textures->pageSize, page, i);
+    float4 t10 = fetchBlockTexel(textures->blocks, textures->pageSize, page, i + (int2)(1, 0));
+    float4 t01 = fetchBlockTexel(textures->blocks, textures->pageSize, page, i + (int2)(0, 1));
+    float4 t11 = fetchBlockTexel(textures->blocks, textures->pageSize, page, i + (int2)(1, 1));
+    return mix(mix(t00, t10, f.x), mix(t01, t11, f.x), f.y);
+}
+
+#ifdef VIRTUAL_TEXTURES
+// Walks from the requested level towards coarser ones until it finds a
+// resident tile, flagging every tile on the way for the host. The coarsest
+// level of each material is pinned in the cache.
+float4 sampleMipVirtual(read_only image2d_array_t cache,
+                        const struct Textures* textures,
+                        int page, float2 offset, int2 size, int level, float2 uv)
+{
+    const int tilesPerRow = textures->pageSize / TILE_SIZE;
+    const int levels = 32 - clz(min(size.x, size.y));
+    for (; level < levels; level++) {
+        float2 texel = mipTexel(offset, size, level, uv);
+        int2 tileCoord = convert_int2(texel) / TILE_SIZE;
+        int tile = (page * tilesPerRow + tileCoord.y) * tilesPerRow + tileCoord.x;
+        if (!textures->pageRequests[tile]) {
+            textures->pageRequests[tile] = 1;
+        }
+
+        int slot = textures->pageTable[tile];
+        if (slot >= 0) {
+            const int layerSlots = CACHE_SLOTS_PER_ROW * CACHE_SLOTS_PER_ROW;
+            int2 slotCoord = (int2)(slot % CACHE_SLOTS_PER_ROW,
+                                    slot % layerSlots / CACHE_SLOTS_PER_ROW);
+            float2 cacheTexel = texel
+                              - convert_float2(tileCoord * TILE_SIZE)
+                              + convert_float2(slotCoord * (TILE_SIZE + 2 * TILE_BORDER) + TILE_BORDER);
+            return read_imagef(cache, mipSampler,
+                               (float4)(cacheTexel, convert_float(slot / layerSlots), 0.0f));
+        }
+    }
+    return (float4)(0.5f, 0.5f, 0.5f, 1.0f);
+}
+#endif
+
+float4 sampleMip(read_only image2d_array_t image,
+                 const struct Textures* textures,
+                 int page, float2 offset, int2 size, int level, float2 uv)
+{
+#if defined(VIRTUAL_TEXTURES)
+    return sampleMipVirtual(image, textures, page, offset, size, level, uv);
+#elif defined(COMPRESSED_TEXTURES)
+    return sampleMipBlocks(textures, page, offset, size, level, uv);
+#else
+    return sampleMipImage(image, page, offset, size, level, uv);
+#endif
+}
+
+float3 sampleDiffuse(struct Ray ray,
+                     struct RayHit hit,
+                     struct Material material,
+                     read_only image2d_array_t diffuse_textures,
+                     const struct Textures* textures)
+{
+    int2 size = convert_int2(material.uv_scale);
+    int levels = 32 - clz(min(size.x, size.y));
+    float lod = clamp(textureLod(ray, hit, size), 0.0f, (float)(levels - 1));
+    int level = (int)lod;
+
+    float4 diffuse = sampleMip(diffuse_textures, textures, material.diffuse,
+                               material.uv_offset, size, level, hit.texcoord);
+    if (level + 1 < levels) {
+        diffuse = mix(diffuse,
+                      sampleMip(diffuse_textures, textures, material.diffuse,
+                                material.uv_offset, size, level + 1, hit.texcoord),
+                      lod - level);
+    }
+    return diffuse.xyz;
+}
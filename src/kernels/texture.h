@@ -0,0 +1,33 @@
+#ifndef TEXTURE_H_
+#define TEXTURE_H_
+
+#include "primitives.h"
+
+struct Textures {
+    global const uint2* blocks;
+    int pageSize;
+    global const int* pageTable;
+    global uint* pageRequests;
+};
+
+float textureLod(struct Ray ray, struct RayHit hit, int2 size);
+float2 mipTexel(float2 offset, int2 size, int level, float2 uv);
+float4 sampleMipImage(read_only image2d_array_t image,
+                      int page, float2 offset, int2 size, int level, float2 uv);
+float3 decode565(uint color);
+float4 fetchBlockTexel(global const uint2* blocks, int pageSize, int page, int2 texel);
+float4 sampleMipBlocks(const struct Textures* textures,
+                       int page, float2 offset, int2 size, int level, float2 uv);
+float4 sampleMipVirtual(read_only image2d_array_t cache,
+                        const struct Textures* textures,
+                        int page, float2 offset, int2 size, int level, float2 uv);
+float4 sampleMip(read_only image2d_array_t image,
+                 const struct Textures* textures,
+                 int page, float2 offset, int2 size, int level, float2 uv);
+float3 sampleDiffuse(struct Ray ray,
+                     struct RayHit hit,
+                     struct Material material,
+                     read_only image2d_array_t diffuse_textures,
+                     const struct Textures* textures);
+
+#endif
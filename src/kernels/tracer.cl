@@ -2,6 +2,7 @@
 #include "intersect.h"
 ////
 #include "shader.h"
+#include "brdf.h"
 #include "options.h"
 
 struct Ray createCameraRay(int2 coord)
@@ -17,8 +18,10 @@ struct Ray createCameraRay(int2 coord)
     float3 direction = normalize((float3)(coord.x * x_ratio - 0.5f,
                                        coord.y * y_ratio - ratio / 2,
                                        -0.3f));
-    return createRay((float3)(0.0f, 0.0f, 0.0f),
-                     direction);
+    struct Ray ray = createRay((float3)(0.0f, 0.0f, 0.0f),
+                               direction);
+    ray.spread = x_ratio / 0.3f;
+    return ray;
 }
 
 float3 rayPoint(struct Ray ray, float t)
@@ -55,65 +58,76 @@ float3 barycentric(float3 loc, struct Triangle triangle)
 }
 
 struct RayHit traceRayAgainstMesh(struct Ray ray,
-                                  global const struct Vertex* vertices,
-                                  global const struct VertexAttributes* vertexAttributes,
-                                  global const Indice* indices,
-                                  global const struct Mesh* meshes,
-                                  int numMesh)
+                                  const struct Geometry* geometry,
+                                  int instance)
 {
     struct RayHit nearestHit;
     nearestHit.dist = (float)(INFINITY);
 
-    struct Mesh mesh = meshes[numMesh];
+    struct Mesh mesh = loadMesh(geometry, instance);
+    struct Ray objectRay = objectSpaceRay(ray, mesh);
     for (int p = 0; p < mesh.num_triangles; p += 3) {
-        struct Triangle triangle = constructTriangle(vertices, vertexAttributes,
-                                                     indices, p, mesh);
-        float3 uvt = intersectTriangle(ray, triangle);
+        float3 uvt = intersectMeshTriangle(ray, objectRay, geometry, p, mesh);
 
         if (nearestHit.dist > uvt.z && uvt.z > 0.0f) {
+            struct Triangle triangle = constructTriangle(geometry->vertices,
+                                                         geometry->vertexAttributes,
+                                                         geometry->indices,
+                                                         p, mesh);
             float3 loc = rayPoint(ray, uvt.z);
             float3 uvw = (float3)(1.0f - uvt.x - uvt.y,
                                  uvt.x,
                                  uvt.y);
-            float3 normal = uvw.x * triangle.aa->normal 
-                          + uvw.y * triangle.ba->normal
-                          + uvw.z * triangle.ca->normal;
+            float3 normal = uvw.x * decodeNormal(triangle.aa)
+                          + uvw.y * decodeNormal(triangle.ba)
+                          + uvw.z * decodeNormal(triangle.ca);
+            float2 ta = decodeTexcoord(triangle.aa);
+            float2 tb = decodeTexcoord(triangle.ba);
+            float2 tc = decodeTexcoord(triangle.ca);
             nearestHit.dist = uvt.z;
             nearestHit.location = loc;
             nearestHit.normal = normalize(rotate_quat(mesh.orientation, normal));
-            nearestHit.texcoord = (uvw.x * triangle.aa->texcoord
-                                 + uvw.y * triangle.ba->texcoord
-                                 + uvw.z * triangle.ca->texcoord).xy;
+            nearestHit.texcoord = uvw.x * ta + uvw.y * tb + uvw.z * tc;
+
+            float2 t1 = tb - ta;
+            float2 t2 = tc - ta;
+            float uvArea = fabs(t1.x * t2.y - t2.x * t1.y);
+            float worldArea = length(cross(triangle.b.position - triangle.a.position,
+                                           triangle.c.position - triangle.a.position));
+            nearestHit.coneWidth = ray.width + ray.spread * uvt.z;
+            nearestHit.lodBias = 0.5f * log2(uvArea / worldArea);
             nearestHit.material = mesh.material;
-            nearestHit.mesh = &meshes[numMesh];
-            nearestHit.indice = &indices[p];
+            nearestHit.instance = instance;
+            nearestHit.indice = &geometry->indices[mesh.base_triangle + p];
         }
     }
     return nearestHit;
 }
 
 struct RayHit traceRayAgainstBVH(struct Ray ray,
-                                 global const struct BVHNode* bvh,
-                                 int numBVHNodes,
-                                 global const struct Vertex* vertices,
-                                 global const struct VertexAttributes* vertexAttributes,
-                                 global const Indice* indices,
-                                 global const struct Mesh* meshes,
-                                 int numMeshes)
+                                 const struct Geometry* geometry)
 {
     struct RayHit nearestHit;
     nearestHit.dist = (float)(INFINITY);
-    for (int b = 0; b < numBVHNodes; b++) {
-        struct BVHNode bvhnode = bvh[b];
-        bvhnode.bounds.min = bvhnode.bounds.min
-                           * bvhnode.scale
-                           + bvhnode.position;
-        bvhnode.bounds.max = bvhnode.bounds.max
-                           * bvhnode.scale
-                           + bvhnode.position;
-        if (intersectAABB(ray, bvhnode.bounds)) {
-            struct RayHit hit = traceRayAgainstMesh(ray, vertices, vertexAttributes,
-                                                    indices, meshes, bvhnode.mesh);
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (geometry->numBVHNodes > 0) {
+        stack[top++] = 0;
+    }
+    while (top > 0) {
+        struct BVHNode node = geometry->bvh[stack[--top]];
+        if (intersectAABB(ray, node.bounds) >= nearestHit.dist) {
+            continue;
+        }
+        if (node.count == 0) {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++) {
+            struct RayHit hit = traceRayAgainstMesh(ray, geometry,
+                                                    geometry->bvhInstances[i]);
             if (hit.dist < nearestHit.dist) {
                 nearestHit = hit;
             }
@@ -122,23 +136,147 @@ struct RayHit traceRayAgainstBVH(struct Ray ray,
     return nearestHit;
 }
 
+#if MAX_BOUNCES > 0
+// Counts a ray against the frame's budget only if there is room for it,
+// so the counter never runs past the budget.
+bool takeRay(global uint* rays, uint rayBudget)
+{
+    uint taken = *rays;
+    while (taken < rayBudget) {
+        uint seen = atomic_cmpxchg(rays, taken, taken + 1);
+        if (seen == taken) {
+            return true;
+        }
+        taken = seen;
+    }
+    return false;
+}
+
+// Iterative specular/glossy bounces. Paths end on a miss, by russian
+// roulette on the path throughput or once the frame's ray budget is spent.
+float3 traceReflections(struct Ray ray,
+                        struct RayHit hit,
+                        const struct Geometry* geometry,
+                        global const struct Light* lights,
+                        int numLights,
+                        global const struct Material* materials,
+                        read_only image2d_array_t diffuse,
+                        const struct Textures* textures,
+                        global struct RayStats* stats,
+                        local struct RayStats* groupStats,
+                        uint rayBudget,
+                        uint* rng)
+{
+    float3 color = (float3)(0.0f, 0.0f, 0.0f);
+    float3 throughput = (float3)(1.0f, 1.0f, 1.0f);
+    struct OccluderCache noCache = { 0, -1, -1, 0 };
+
+    int bounce = 0;
+    for (; bounce < MAX_BOUNCES; bounce++) {
+        struct Material material = materials[hit.material];
+        throughput *= fresnel(material.fresnel0, hit.normal, -ray.direction);
+
+        if (bounce >= ROULETTE_MIN_BOUNCES) {
+            float survival = clamp(fmax(throughput.x, fmax(throughput.y, throughput.z)),
+                                   0.05f, 0.95f);
+            if (randomFloat(rng) > survival) {
+                atomic_inc(&groupStats->roulette);
+                break;
+            }
+            throughput /= survival;
+        }
+
+        if (!takeRay(&stats->rays, rayBudget)) {
+            atomic_inc(&groupStats->budget_exhausted);
+            break;
+        }
+
+        float3 direction = reflect(ray.direction, hit.normal)
+                         + material.roughness * material.roughness * randomDirection(rng);
+        direction = normalize(direction);
+        if (dot(direction, hit.normal) <= 0.0f) {
+            direction = reflect(ray.direction, hit.normal);
+        }
+
+        float spread = ray.spread + material.roughness * material.roughness;
+        ray = createRay(hit.location + hit.normal * 0.01f, direction);
+        ray.width = hit.coneWidth;
+        ray.spread = spread;
+        hit = traceRayAgainstBVH(ray, geometry);
+        if (hit.dist == (float)INFINITY) {
+            atomic_inc(&groupStats->misses);
+            bounce++;
+            break;
+        }
+
+        color += throughput * gatherLight(ray, hit, geometry, lights, numLights,
+                                          materials, diffuse, textures, &noCache);
+    }
+
+    atomic_inc(&groupStats->path_lengths[min(bounce, PATH_LENGTH_BINS - 1)]);
+    return color;
+}
+#endif
+
 void kernel tracer(write_only image2d_t img,
                    global const struct Light* lights,
                    int numLights,
                    global const struct Vertex* vertices,
                    global const struct VertexAttributes* vertexAttributes,
                    global const Indice* indices,
-                   global const struct Mesh* meshes,
-                   int numMeshes,
+                   global const struct Instance* instances,
+                   int numInstances,
                    global const struct BVHNode* bvh,
                    int numBVHNodes,
                    global const struct Material* materials,
-                   read_only image2d_array_t diffuse)
+                   read_only image2d_array_t diffuse,
+                   global struct Reservoir* reservoirs,
+                   global const struct Reservoir* previousReservoirs,
+                   uint frame,
+                   global struct OccluderCacheEntry* occluderCache,
+                   global struct RayStats* stats,
+                   uint rayBudget,
+                   global const uint2* diffuseBlocks,
+                   int atlasPageSize,
+                   global const int* pageTable,
+                   global uint* pageRequests,
+                   global const struct PrecomputedTriangle* triangles,
+                   global const struct MeshGeometry* geometries,
+                   global const int* bvhInstances)
 {
     const int2 coord = (int2)(get_global_id(0), get_global_id(1));
+#ifdef SCENE_LIGHTS
+    // Scene specialised build, the light count is known at compile time.
+    numLights = SCENE_LIGHTS;
+#endif
+#if MAX_BOUNCES > 0
+    local struct RayStats groupStats;
+    const int localId = get_local_id(1) * get_local_size(0) + get_local_id(0);
+    if (localId == 0) {
+        groupStats.rays = 0;
+        groupStats.roulette = 0;
+        groupStats.budget_exhausted = 0;
+        groupStats.misses = 0;
+        for (int i = 0; i < PATH_LENGTH_BINS; i++) {
+            groupStats.path_lengths[i] = 0;
+        }
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+#endif
+    const struct Geometry geometry = {
+        vertices,
+        vertexAttributes,
+        indices,
+        instances,
+        numInstances,
+        geometries,
+        bvh,
+        numBVHNodes,
+        bvhInstances,
+        triangles
+    };
     struct Ray ray = createCameraRay(coord);
-    struct RayHit hit = traceRayAgainstBVH(ray, bvh, numBVHNodes, vertices, 
-                                               vertexAttributes, indices, meshes, numMeshes);
+    struct RayHit hit = traceRayAgainstBVH(ray, &geometry);
 
 
     float3 color = (float3)(0.0f, 0.0f, 0.0f);
@@ -151,19 +289,58 @@ void kernel tracer(write_only image2d_t img,
         float norm_depth = hit.location.z * -0.005f;
         color = (float3)(norm_depth);
 #else
-        const struct Geometry geometry = {
-            vertices,
-            vertexAttributes,
-            indices,
-            meshes,
-            numMeshes,
-            bvh,
-            numBVHNodes
+        const struct Textures textures = {
+            diffuseBlocks,
+            atlasPageSize,
+            pageTable,
+            pageRequests
+        };
+        struct OccluderCache occluders = {
+            occluderCache
+                + (coord.y * get_global_size(0) + coord.x) * numLights,
+            hit.indice - indices,
+            hit.instance,
+            instances[hit.instance].revision
         };
+#ifdef LIGHT_RESAMPLING
+        const struct ReservoirBuffers reservoirBuffers = {
+            reservoirs,
+            previousReservoirs,
+            coord,
+            frame
+        };
+        color = gatherLightResampled(ray, hit, &geometry,
+                lights, numLights, materials, diffuse, &textures, &reservoirBuffers,
+                &occluders);
+#else
         color = gatherLight(ray, hit, &geometry,
-                lights, numLights, materials, diffuse);
+                lights, numLights, materials, diffuse, &textures, &occluders);
+#endif
+#if MAX_BOUNCES > 0
+        uint rng = wangHash(hashSeed(coord, frame));
+        color += traceReflections(ray, hit, &geometry, lights, numLights,
+                                  materials, diffuse, &textures, stats, &groupStats,
+                                  rayBudget, &rng);
+#endif
+#endif
+    }
+#ifdef LIGHT_RESAMPLING
+    else {
+        reservoirs[coord.y * get_global_size(0) + coord.x] = emptyReservoir(INFINITY);
+    }
 #endif
+
+#if MAX_BOUNCES > 0
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if (localId == 0) {
+        atomic_add(&stats->roulette, groupStats.roulette);
+        atomic_add(&stats->budget_exhausted, groupStats.budget_exhausted);
+        atomic_add(&stats->misses, groupStats.misses);
     }
+    if (localId < PATH_LENGTH_BINS) {
+        atomic_add(&stats->path_lengths[localId], groupStats.path_lengths[localId]);
+    }
+#endif
 
     write_imagef(img, coord, (float4)(color, 1.0f));
 }
@@ -1,4 +1,6 @@
 #include "primitives.h"
+#include "sampling.h"
+#include "shader.h"
 
 struct Ray createCameraRay(int2 coord);
 float3 rayPoint(struct Ray ray, float t);
@@ -6,28 +8,45 @@ float lengthSquared(float3 a);
 float3 reflect(float3 v, float3 n);
 float3 barycentric(float3 loc, struct Triangle triangle);
 struct RayHit traceRayAgainstMesh(struct Ray ray,
-                                  global const struct Vertex* vertices,
-                                  global const struct VertexAttributes* vertexAttributes,
-                                  global const Indice* indices,
-                                  global const struct Mesh* meshes,
-                                  int numMesh);
+                                  const struct Geometry* geometry,
+                                  int instance);
 struct RayHit traceRayAgainstBVH(struct Ray ray,
-                                 global const struct BVHNode* bvh,
-                                 int numBVHNodes,
-                                 global const struct Vertex* vertices,
-                                 global const struct VertexAttributes* vertexAttributes,
-                                 global const Indice* indices,
-                                 global const struct Mesh* meshes,
-                                 int numMeshes);
+                                 const struct Geometry* geometry);
+bool takeRay(global uint* rays, uint rayBudget);
+float3 traceReflections(struct Ray ray,
+                        struct RayHit hit,
+                        const struct Geometry* geometry,
+                        global const struct Light* lights,
+                        int numLights,
+                        global const struct Material* materials,
+                        read_only image2d_array_t diffuse,
+                        const struct Textures* textures,
+                        global struct RayStats* stats,
+                        local struct RayStats* groupStats,
+                        uint rayBudget,
+                        uint* rng);
 void kernel tracer(write_only image2d_t img,
                    global const struct Light* lights,
                    int numLights,
                    global const struct Vertex* vertices,
                    global const struct VertexAttributes* vertexAttributes,
                    global const Indice* indices,
-                   global const struct Mesh* meshes,
-                   int numMeshes,
+                   global const struct Instance* instances,
+                   int numInstances,
                    global const struct BVHNode* bvh,
                    int numBVHNodes,
                    global const struct Material* materials,
-                   read_only image2d_array_t textures);
+                   read_only image2d_array_t textures,
+                   global struct Reservoir* reservoirs,
+                   global const struct Reservoir* previousReservoirs,
+                   uint frame,
+                   global struct OccluderCacheEntry* occluderCache,
+                   global struct RayStats* stats,
+                   uint rayBudget,
+                   global const uint2* diffuseBlocks,
+                   int atlasPageSize,
+                   global const int* pageTable,
+                   global uint* pageRequests,
+                   global const struct PrecomputedTriangle* triangles,
+                   global const struct MeshGeometry* geometries,
+                   global const int* bvhInstances);
@@ -162,6 +162,7 @@ int main()
 
     int width = config["width"].as<int>();
     int height = config["height"].as<int>();
+    verbose = config["verbose"] && config["verbose"].as<bool>();
 
     auto window = init_gl(width, height);
 
@@ -184,12 +185,16 @@ int main()
 
     Tracer::options current_options = {
         shaded,
-        true
+        true,
+        false,
+        true,
+        0,
+        false
     };
 
 
-    tracer.load_kernels(current_options);
     tracer.set_scene(scene);
+    tracer.load_kernels(current_options);
     tracer.set_texture(drawer.texture(), width, height);
 
     rasterizer.set_scene(scene);
@@ -210,6 +215,46 @@ int main()
     };
 
     int renderer = 1;
+    int ray_budget = 1024;
+
+    // Instances added from the Controls window, with the mesh each one
+    // loaded, if it was not in the scene already. Removal goes in reverse,
+    // so the instance removed is always the last one and nothing moves.
+    char edit_mesh[64] = "suzanne.iqm";
+    std::vector<std::pair<cl_int, bool>> added;
+    auto add_instance = [&] {
+        bool loaded = std::any_of(scene.geometries.begin(), scene.geometries.end(),
+                                  [&](const Geometry& g) { return g.file == edit_mesh; });
+        try {
+            cl_int geometry = scene.add_mesh(edit_mesh);
+            float x = -30.0f + 12.0f * (added.size() % 6);
+            float y = 20.0f - 12.0f * (added.size() / 6 % 4);
+            Transform placement = { glm::quat(1.0f, 0.0f, 0.0f, 0.0f),
+                                    glm::vec3(x, y, -110.0f), 5.0f };
+            scene.add_instance(geometry, 0, placement);
+            added.emplace_back(geometry, !loaded);
+        } catch (std::exception& err) {
+            std::cerr << err.what() << std::endl;
+        }
+    };
+    auto remove_instance = [&] {
+        auto removed = added.back();
+        added.pop_back();
+        scene.remove_instance(scene.instances.size() - 1);
+        bool shared = std::any_of(added.begin(), added.end(),
+                                  [&](const std::pair<cl_int, bool>& a) {
+                                      return a.first == removed.first;
+                                  });
+        if (removed.second && !shared) {
+            scene.remove_mesh(removed.first);
+        }
+    };
+    // Churning adds an instance every frame up to a full grid, then removes
+    // one every frame back to none, so edits land on back to back frames
+    // while the host mirrors grow and shrink.
+    bool churn = false;
+    bool churn_growing = true;
+    const size_t churn_instances = 24;
 
     while (!glfwWindowShouldClose(window)) {
         glfwPollEvents();
@@ -225,17 +270,82 @@ int main()
         ImGui::PlotLines("", getTime, 
                          &frameTimes, frameTimes.size(),
                          0, nullptr, 0.0f, 100.0f, ImVec2(150.0f, 100.0f)); 
+        ImGui::Value("Uploaded (bytes)", (unsigned int)scene.uploaded_bytes);
+        ImGui::Value("Instance triangles", (unsigned int)scene.selected_triangles);
+        if (renderer == 0 && current_options.bounces > 0) {
+            auto & stats = tracer.stats();
+            std::array<float, 16> path_lengths;
+            std::copy(std::begin(stats.path_lengths), std::end(stats.path_lengths),
+                      path_lengths.begin());
+            ImGui::Value("Secondary rays", stats.rays);
+            ImGui::Value("Roulette", stats.roulette);
+            ImGui::Value("Budget exhausted", stats.budget_exhausted);
+            ImGui::Value("Misses", stats.misses);
+            ImGui::PlotHistogram("Path lengths", path_lengths.data(),
+                                 current_options.bounces + 1, 0, nullptr,
+                                 0.0f, FLT_MAX, ImVec2(150.0f, 100.0f));
+        }
         ImGui::End();
         ImGui::Begin("Controls", &controlsWindow);
         ImGui::Combo("Renderer", &renderer, "Raytracer\0Rasterizer\0\0");
         if (ImGui::Button("Reload kernels")) {
             tracer.reload_kernels();
         }
+        ImGui::SameLine();
+        if (ImGui::Button("Benchmark textures")) {
+            tracer.benchmark_textures();
+        }
+        ImGui::SameLine();
+        if (ImGui::Button("Benchmark specialization")) {
+            tracer.benchmark_specialization();
+        }
         ImGui::Combo("Display", (int*)&current_options.dspo, display_options); 
         if (current_options.dspo == shaded) {
             ImGui::Checkbox("Shadows", &current_options.shadows);
+            ImGui::Checkbox("Light resampling", &current_options.light_resampling);
+            ImGui::Checkbox("Occluder cache", &current_options.occluder_cache);
+            ImGui::Checkbox("Specialize to scene", &current_options.specialize);
+            ImGui::SliderInt("Bounces", &current_options.bounces, 0, 8);
+            if (current_options.bounces > 0
+             && ImGui::SliderInt("Ray budget (k)", &ray_budget, 0, 4096)) {
+                tracer.set_ray_budget(ray_budget * 1024);
+            }
+        }
+        ImGui::InputText("Mesh", edit_mesh, sizeof(edit_mesh));
+        if (ImGui::Button("Add instance")) {
+            add_instance();
+        }
+        if (!added.empty()) {
+            ImGui::SameLine();
+            if (ImGui::Button("Remove instance")) {
+                remove_instance();
+            }
+        }
+        ImGui::SameLine();
+        ImGui::Checkbox("Churn instances", &churn);
+        if (churn) {
+            if (added.empty()) {
+                churn_growing = true;
+            } else if (added.size() >= churn_instances) {
+                churn_growing = false;
+            }
+            size_t before = added.size();
+            if (churn_growing) {
+                add_instance();
+            } else {
+                remove_instance();
+            }
+            if (added.size() == before) {
+                churn = false;
+            }
         }
         ImGui::End();
+        auto build_log = tracer.build_log();
+        if (!build_log.empty()) {
+            ImGui::Begin("Build log");
+            ImGui::TextUnformatted(build_log.c_str());
+            ImGui::End();
+        }
 
         scene.update();
         switch(renderer){
@@ -1,19 +1,32 @@
 #version 410
 layout(location = 0) in vec3 position;
-layout(location = 1) in vec3 normal;
+layout(location = 1) in vec2 octNormal;
 layout(location = 2) in vec2 texcoord;
 
 uniform mat4 orientation;
 uniform vec3 translation;
 uniform vec3 scale;
+uniform vec3 boundsMin;
+uniform vec3 boundsExtent;
 uniform mat4 perspMat;
 
 out vec3 f_normal;
 out vec2 f_texcoord;
 
+vec3 decodeNormal(vec2 e)
+{
+    vec3 n = vec3(e, 1.0f - abs(e.x) - abs(e.y));
+    if (n.z < 0.0f) {
+        n.xy = (1.0f - abs(n.yx)) * vec2(n.x >= 0.0f ? 1.0f : -1.0f,
+                                         n.y >= 0.0f ? 1.0f : -1.0f);
+    }
+    return normalize(n);
+}
+
 void main()
 {
-    vec4 pos = vec4(position, 1.0f)
+    vec3 normal = decodeNormal(octNormal);
+    vec4 pos = vec4(boundsMin + position * boundsExtent, 1.0f)
              * orientation
              * vec4(scale, 1.0f) 
              + vec4(translation, 1.0f);
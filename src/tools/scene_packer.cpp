@@ -0,0 +1,23 @@
+#include "../Scene.hpp"
+#include "../ScenePackage.hpp"
+
+#include <iostream>
+
+// Bakes a scene description into a package that Scene::load can map
+// directly. Paths resolve like the tracer's, so run it from the build dir.
+int main(int argc, char** argv)
+{
+    if (argc != 3) {
+        std::cerr << "usage: " << argv[0] << " <scene.yaml> <scene.pack>" << std::endl;
+        return 1;
+    }
+
+    try {
+        auto scene = Scene::read(argv[1]);
+        write_package(scene, argv[2]);
+    } catch (const std::exception & e) {
+        std::cerr << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}